@@ -0,0 +1,717 @@
+/*
+ * Implementation of the x86-64 baseline JIT for the UM. Straight-line runs
+ * of segment zero instructions (ending after LOADP, HALT or an invalid
+ * opcode) are translated into native code in an mmap region that is
+ * writable or executable but never both. Arithmetic, conditional move,
+ * load value and in-bounds SLOAD and SSTORE are emitted inline against the
+ * register array and segment table; the other instructions call back into
+ * the handlers in um.h.
+ *
+ * Blocks run on into one another without returning to C: each ends by
+ * jumping through the table of block entry points, to the block for the
+ * next word or, for a LOADP of segment zero, for its target. Control only
+ * comes back to jit_execute for a LOADP of another segment, a block not
+ * translated yet, or the end of segment zero.
+ *
+ * Translated words are watched through the segment 0 write barrier in
+ * memory_put; a store into one drops just the blocks that cover that word
+ * by clearing their table entries. load_program replacing segment zero
+ * drops them all.
+ *
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "um.h"
+#include "jit.h"
+
+#define JIT_CODE_SIZE (32 * 1024 * 1024)
+#define JIT_MAX_INSTRUCTIONS 256
+#define JIT_MAX_INSTRUCTION_BYTES 96
+#define JIT_MAX_BLOCK_BYTES (64 + JIT_MAX_INSTRUCTIONS * \
+                             JIT_MAX_INSTRUCTION_BYTES)
+
+/* x86-64 register numbers used by the emitters */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define R12 12
+#define R13 13
+#define R14 14
+
+/* Pointer to a struct that contains the data structure for this module */
+typedef struct Jit_T *Jit_T;
+
+/* The trampoline into translated code: runs block with the register array
+   and the Jit_T set up, and returns the segment zero index to continue at
+   once control leaves translated code */
+typedef uint32_t (*Jit_enter)(uint32_t *regs, Jit_T jit, uint8_t *block);
+
+/* Struct definition of a Jit_T which contains:
+   - the UM being run and its memory
+   - the entry point of the block starting at each word of segment zero,
+     and how many words that block covers (meaningful where entry is set)
+   - the length of segment zero the tables were sized for
+   - the code region, how much of it is used, and how much of that holds
+     the stubs every block shares: the trampoline, exit and lookup
+   Translated code reads mem, entry and len through the Jit_T */
+struct Jit_T {
+    UM_T um;
+    Memory_T mem;
+    uint8_t **entry;
+    uint16_t *span;
+    uint32_t len;
+    uint8_t *code;
+    size_t used;
+    size_t stubs;
+    Jit_enter enter;
+    uint8_t *exit;
+    uint8_t *lookup;
+};
+
+/* Name: jit_protect
+ * Input: a Jit_T struct, a byte range of the code region, and mmap
+ *        protection flags
+ * Output: N/A
+ * Does: Sets the protection of the pages holding the range
+ * Error: Asserts if mprotect fails
+ */
+static void jit_protect(Jit_T jit, size_t from, size_t to, int prot)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    from &= ~(page - 1);
+    to = (to + page - 1) & ~(page - 1);
+    if (to > JIT_CODE_SIZE) {
+        to = JIT_CODE_SIZE;
+    }
+
+    int status = mprotect(jit->code + from, to - from, prot);
+    assert(status == 0);
+    (void)status;
+}
+
+/* Name: jit_flush
+ * Input: a Jit_T struct
+ * Output: N/A
+ * Does: Forgets every translated block and reuses the code region after
+ *       the stubs
+ * Notes: only called from jit_execute, when no block is running
+ */
+static void jit_flush(Jit_T jit)
+{
+    memset(jit->entry, 0, jit->len * sizeof(*jit->entry));
+    jit->used = jit->stubs;
+}
+
+/* Name: jit_invalidate
+ * Input: a Jit_T struct
+ * Output: 1 if any blocks were dropped, otherwise 0
+ * Does: Drops the blocks covering each word of segment zero that the
+ *       write barrier reports as written. A block is at most
+ *       JIT_MAX_INSTRUCTIONS long, so only those starting that far
+ *       before the word need checking. Their code stays in the region
+ *       until the next jit_flush.
+ */
+static int jit_invalidate(Jit_T jit)
+{
+    uint32_t off;
+    int dropped = 0;
+
+    while (memory_take_zero_dirty(jit->mem, &off)) {
+        uint32_t first = off >= JIT_MAX_INSTRUCTIONS ?
+                         off - (JIT_MAX_INSTRUCTIONS - 1) : 0;
+
+        for (uint32_t pc = first; pc <= off && pc < jit->len; pc++) {
+            if (jit->entry[pc] != NULL && pc + jit->span[pc] > off) {
+                jit->entry[pc] = NULL;
+                dropped = 1;
+            }
+        }
+    }
+
+    return dropped;
+}
+
+/* Name: jit_free_tables
+ * Input: a Jit_T struct
+ * Output: N/A
+ * Does: Frees the block tables
+ */
+static void jit_free_tables(Jit_T jit)
+{
+    um_zero_free(jit->entry, ((size_t)jit->len + 1) * sizeof(*jit->entry));
+    um_zero_free(jit->span, ((size_t)jit->len + 1) * sizeof(*jit->span));
+}
+
+/* Name: jit_reset
+ * Input: a Jit_T struct
+ * Output: N/A
+ * Does: Sizes the block tables for the current segment zero and flushes.
+ *       The entry one past the end stays NULL, so running off the end of
+ *       segment zero leaves translated code.
+ * Error: Asserts if memory is not allocated
+ */
+static void jit_reset(Jit_T jit)
+{
+    jit_free_tables(jit);
+
+    jit->len = jit->mem->segments[0].len;
+    jit->entry = um_zero_alloc(((size_t)jit->len + 1) * sizeof(*jit->entry));
+    jit->span = um_zero_alloc(((size_t)jit->len + 1) * sizeof(*jit->span));
+
+    jit->used = jit->stubs;
+}
+
+/* Callbacks made from translated code. Each takes the instruction's
+   register numbers and defers to the handler in um.h. */
+
+static uint32_t jit_sload(Jit_T jit, uint32_t ra, uint32_t rb, uint32_t rc)
+{
+    segmented_load(jit->um, ra, rb, rc);
+    return 0;
+}
+
+/* Returns 1 if the store dropped translated blocks, in which case the
+   calling block may be gone and must not run on */
+static uint32_t jit_sstore(Jit_T jit, uint32_t ra, uint32_t rb, uint32_t rc)
+{
+    segmented_store(jit->um, ra, rb, rc);
+
+    return jit_invalidate(jit);
+}
+
+/* Only called with a zero divisor, which divide then faults on */
+static uint32_t jit_div(Jit_T jit, uint32_t ra, uint32_t rb, uint32_t rc)
+{
+    divide(jit->um, ra, rb, rc);
+    return 0;
+}
+
+static uint32_t jit_map(Jit_T jit, uint32_t ra, uint32_t rb, uint32_t rc)
+{
+    map_segment(jit->um, ra, rb, rc);
+    return 0;
+}
+
+static uint32_t jit_unmap(Jit_T jit, uint32_t ra, uint32_t rb, uint32_t rc)
+{
+    unmap_segment(jit->um, ra, rb, rc);
+    return 0;
+}
+
+static uint32_t jit_out(Jit_T jit, uint32_t ra, uint32_t rb, uint32_t rc)
+{
+    output(jit->um, ra, rb, rc);
+    return 0;
+}
+
+static uint32_t jit_in(Jit_T jit, uint32_t ra, uint32_t rb, uint32_t rc)
+{
+    input(jit->um, ra, rb, rc);
+    return 0;
+}
+
+static uint32_t jit_halt(Jit_T jit, uint32_t ra, uint32_t rb, uint32_t rc)
+{
+    halt(jit->um, ra, rb, rc);
+    return 0;
+}
+
+/* Faults even where UM_CHECK compiles to nothing */
+static uint32_t jit_invalid(Jit_T jit, uint32_t ra, uint32_t rb,
+                            uint32_t rc)
+{
+    (void)jit;
+    (void)ra;
+    (void)rb;
+    (void)rc;
+    UM_CHECK(0);
+    um_fault("invalid instruction");
+}
+
+/* Emitters. In translated code rbx holds the register array, r12 the
+   Jit_T, r13 the block entry table and r14 the Memory_T; register n lives
+   at [rbx + 4n]. */
+
+static inline void emit_byte(Jit_T jit, uint8_t byte)
+{
+    jit->code[jit->used++] = byte;
+}
+
+static inline void emit_u32(Jit_T jit, uint32_t value)
+{
+    memcpy(jit->code + jit->used, &value, sizeof(value));
+    jit->used += sizeof(value);
+}
+
+static inline void emit_u64(Jit_T jit, uint64_t value)
+{
+    memcpy(jit->code + jit->used, &value, sizeof(value));
+    jit->used += sizeof(value);
+}
+
+static void emit_bytes(Jit_T jit, const uint8_t *bytes, size_t count)
+{
+    memcpy(jit->code + jit->used, bytes, count);
+    jit->used += count;
+}
+
+/* mov eax, [rbx + 4r] */
+static inline void emit_load_eax(Jit_T jit, uint32_t r)
+{
+    emit_byte(jit, 0x8b);
+    emit_byte(jit, 0x43);
+    emit_byte(jit, r * 4);
+}
+
+/* mov [rbx + 4r], eax */
+static inline void emit_store_eax(Jit_T jit, uint32_t r)
+{
+    emit_byte(jit, 0x89);
+    emit_byte(jit, 0x43);
+    emit_byte(jit, r * 4);
+}
+
+/* <op> eax, [rbx + 4r] for a two byte opcode prefix */
+static inline void emit_op_eax(Jit_T jit, uint8_t op1, uint8_t op2,
+                               uint32_t r)
+{
+    if (op1 != 0) {
+        emit_byte(jit, op1);
+    }
+    emit_byte(jit, op2);
+    emit_byte(jit, 0x43);
+    emit_byte(jit, r * 4);
+}
+
+/* <op> reg, [base + disp] for a one byte opcode, on 64 bits if wide */
+static void emit_op_mem(Jit_T jit, int wide, uint8_t op, int reg, int base,
+                        int32_t disp)
+{
+    uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+    int mod = (disp == 0 && (base & 7) != 5) ? 0 :
+              (disp >= -128 && disp <= 127) ? 1 : 2;
+
+    if (rex != 0x40) {
+        emit_byte(jit, rex);
+    }
+    emit_byte(jit, op);
+    emit_byte(jit, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4) {
+        emit_byte(jit, 0x24);           /* SIB: base only */
+    }
+    if (mod == 1) {
+        emit_byte(jit, (uint8_t)disp);
+    } else if (mod == 2) {
+        emit_u32(jit, (uint32_t)disp);
+    }
+}
+
+/* jcc or jmp rel8 forward; returns the spot for patch_jump */
+static size_t emit_jump8(Jit_T jit, uint8_t op)
+{
+    emit_byte(jit, op);
+    emit_byte(jit, 0);
+    return jit->used;
+}
+
+/* Points a jump from emit_jump8 at the current position */
+static void patch_jump(Jit_T jit, size_t from)
+{
+    assert(jit->used - from <= 127);
+    jit->code[from - 1] = (uint8_t)(jit->used - from);
+}
+
+/* jmp rel32 (op 0xe9) or jcc rel32 (op 0x80 to 0x8f) to target */
+static void emit_jump32(Jit_T jit, uint8_t op, const uint8_t *target)
+{
+    if (op != 0xe9) {
+        emit_byte(jit, 0x0f);
+    }
+    emit_byte(jit, op);
+    emit_u32(jit, (uint32_t)(target - (jit->code + jit->used + 4)));
+}
+
+/* mov eax, pc; jmp exit */
+static void emit_exit(Jit_T jit, uint32_t pc)
+{
+    emit_byte(jit, 0xb8);
+    emit_u32(jit, pc);
+    emit_jump32(jit, 0xe9, jit->exit);
+}
+
+/* Continues at the block for the constant index pc (at most len), read
+   straight from its table entry: mov rdx, [r13 + 8pc]; test rdx, rdx;
+   jnz over an exit at pc; jmp rdx */
+static void emit_goto(Jit_T jit, uint32_t pc)
+{
+    if (pc > INT32_MAX / sizeof(*jit->entry)) {
+        emit_byte(jit, 0xb8);
+        emit_u32(jit, pc);
+        emit_jump32(jit, 0xe9, jit->lookup);
+        return;
+    }
+
+    emit_op_mem(jit, 1, 0x8b, RDX, R13, (int32_t)(pc * sizeof(*jit->entry)));
+    emit_bytes(jit, (const uint8_t[]){ 0x48, 0x85, 0xd2 }, 3);
+    size_t found = emit_jump8(jit, 0x75);
+    emit_exit(jit, pc);
+    patch_jump(jit, found);
+    emit_bytes(jit, (const uint8_t[]){ 0xff, 0xe2 }, 2);
+}
+
+/* helper(r12, ra, rb, rc) through rax */
+static void emit_call(Jit_T jit, void *helper, uint32_t ra, uint32_t rb,
+                      uint32_t rc)
+{
+    emit_byte(jit, 0x4c);               /* mov rdi, r12 */
+    emit_byte(jit, 0x89);
+    emit_byte(jit, 0xe7);
+    emit_byte(jit, 0xbe);               /* mov esi, ra */
+    emit_u32(jit, ra);
+    emit_byte(jit, 0xba);               /* mov edx, rb */
+    emit_u32(jit, rb);
+    emit_byte(jit, 0xb9);               /* mov ecx, rc */
+    emit_u32(jit, rc);
+    emit_byte(jit, 0x48);               /* mov rax, helper */
+    emit_byte(jit, 0xb8);
+    emit_u64(jit, (uint64_t)(uintptr_t)helper);
+    emit_byte(jit, 0xff);               /* call rax */
+    emit_byte(jit, 0xd0);
+}
+
+/* The probe of segmented_load and segmented_store: with the segment
+   number in eax and the offset in edx, leaves the segment's words in rcx,
+   or takes one of the two jumps returned in slow if the segment is not
+   in the table or the offset is not below the Segment field at limit.
+   cmp eax, [r14 + seg_count]; jae; mov rcx, [r14 + segments];
+   shl rax, 4; add rcx, rax; cmp edx, [rcx + limit]; jae; mov rcx, [rcx] */
+static void emit_probe(Jit_T jit, size_t limit, size_t slow[2])
+{
+    assert(sizeof(Segment) == 16);
+
+    emit_op_mem(jit, 0, 0x3b, RAX, R14,
+                offsetof(struct Memory_T, seg_count));
+    slow[0] = emit_jump8(jit, 0x73);
+    emit_op_mem(jit, 1, 0x8b, RCX, R14,
+                offsetof(struct Memory_T, segments));
+    emit_bytes(jit, (const uint8_t[]){ 0x48, 0xc1, 0xe0, 0x04,
+                                       0x48, 0x01, 0xc1 }, 7);
+    emit_op_mem(jit, 0, 0x3b, RDX, RCX, limit);
+    slow[1] = emit_jump8(jit, 0x73);
+    emit_op_mem(jit, 1, 0x8b, RCX, RCX, offsetof(Segment, data));
+}
+
+/* Name: jit_emit_stubs
+ * Input: a Jit_T struct with a writable code region
+ * Output: N/A
+ * Does: Writes the code every block shares at the start of the region:
+ *       - the trampoline, which saves the callee-saved registers it uses
+ *         (five pushes keep calls 16-byte aligned), loads rbx, r12, r13
+ *         and r14 and jumps to the block
+ *       - exit, which returns eax to jit_execute
+ *       - lookup, which continues at the block for the index in eax, or
+ *         exits with it if that is past segment zero or not translated
+ */
+static void jit_emit_stubs(Jit_T jit)
+{
+    /* push rbx; push rbp; push r12; push r13; push r14; mov rbx, rdi;
+       mov r12, rsi */
+    static const uint8_t enter[] = {
+        0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56,
+        0x48, 0x89, 0xfb, 0x49, 0x89, 0xf4
+    };
+    /* pop r14; pop r13; pop r12; pop rbp; pop rbx; ret */
+    static const uint8_t leave[] = {
+        0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3
+    };
+
+    uint8_t *start = jit->code + jit->used;
+    memcpy(&jit->enter, &start, sizeof(jit->enter));
+    emit_bytes(jit, enter, sizeof(enter));
+    emit_op_mem(jit, 1, 0x8b, R13, RSI, offsetof(struct Jit_T, entry));
+    emit_op_mem(jit, 1, 0x8b, R14, RSI, offsetof(struct Jit_T, mem));
+    emit_bytes(jit, (const uint8_t[]){ 0xff, 0xe2 }, 2);
+
+    jit->exit = jit->code + jit->used;
+    emit_bytes(jit, leave, sizeof(leave));
+
+    /* cmp eax, [r12 + len]; jae exit; mov rdx, [r13 + 8rax];
+       test rdx, rdx; jz exit; jmp rdx */
+    jit->lookup = jit->code + jit->used;
+    emit_op_mem(jit, 0, 0x3b, RAX, R12, offsetof(struct Jit_T, len));
+    emit_jump32(jit, 0x83, jit->exit);
+    emit_bytes(jit, (const uint8_t[]){ 0x49, 0x8b, 0x54, 0xc5, 0x00,
+                                       0x48, 0x85, 0xd2 }, 8);
+    emit_jump32(jit, 0x84, jit->exit);
+    emit_bytes(jit, (const uint8_t[]){ 0xff, 0xe2 }, 2);
+
+    jit->stubs = jit->used;
+}
+
+/* Name: jit_compile
+ * Input: a Jit_T struct and a segment zero index
+ * Output: the entry point of a block starting at index start
+ * Does: Translates instructions from start up to and including the next
+ *       LOADP, HALT or invalid opcode, or up to the end of segment zero
+ *       or JIT_MAX_INSTRUCTIONS, records the block in the tables and
+ *       watches the words it covers. The pages written are made writable
+ *       for the translation and executable again after it.
+ */
+static uint8_t *jit_compile(Jit_T jit, uint32_t start)
+{
+    if (jit->used + JIT_MAX_BLOCK_BYTES > JIT_CODE_SIZE) {
+        jit_flush(jit);
+    }
+
+    size_t first = jit->used;
+    uint8_t *block = jit->code + first;
+    uint32_t pc = start;
+    int ended = 0;
+
+    /* The register and value of an LV just before, for a LOADP whose
+       target is then known */
+    int lv_reg = -1;
+    uint32_t lv_value = 0;
+
+    jit_protect(jit, first, first + JIT_MAX_BLOCK_BYTES,
+                PROT_READ | PROT_WRITE);
+
+    while (!ended && pc < jit->len && pc - start < JIT_MAX_INSTRUCTIONS) {
+        uint32_t word = memory_get(jit->mem, 0, pc);
+        uint32_t op = word >> OP_LSB;
+        uint32_t ra = (word >> RA_LSB) & R_MASK;
+        uint32_t rb = (word >> RB_LSB) & R_MASK;
+        uint32_t rc = (word >> RC_LSB) & R_MASK;
+        size_t before = jit->used;
+        int prev_lv_reg = lv_reg;
+        size_t slow[2], done, kept;
+
+        memory_watch_zero(jit->mem, pc);
+        pc++;
+        lv_reg = -1;
+
+        switch (op) {
+        case CMOV:
+            /* mov eax, [ra]; mov ecx, [rc]; test ecx, ecx;
+               cmovne eax, [rb]; mov [ra], eax */
+            emit_load_eax(jit, ra);
+            emit_byte(jit, 0x8b);
+            emit_byte(jit, 0x4b);
+            emit_byte(jit, rc * 4);
+            emit_byte(jit, 0x85);
+            emit_byte(jit, 0xc9);
+            emit_op_eax(jit, 0x0f, 0x45, rb);
+            emit_store_eax(jit, ra);
+            break;
+        case ADD:
+            emit_load_eax(jit, rb);
+            emit_op_eax(jit, 0, 0x03, rc);
+            emit_store_eax(jit, ra);
+            break;
+        case MUL:
+            emit_load_eax(jit, rb);
+            emit_op_eax(jit, 0x0f, 0xaf, rc);
+            emit_store_eax(jit, ra);
+            break;
+        case DIV:
+            /* mov ecx, [rc]; test ecx, ecx; jnz over the helper, which
+               faults on zero after writing out buffered output;
+               xor edx, edx; div ecx */
+            emit_byte(jit, 0x8b);
+            emit_byte(jit, 0x4b);
+            emit_byte(jit, rc * 4);
+            emit_byte(jit, 0x85);
+            emit_byte(jit, 0xc9);
+            kept = emit_jump8(jit, 0x75);
+            emit_call(jit, (void *)(uintptr_t)jit_div, ra, rb, rc);
+            done = emit_jump8(jit, 0xeb);
+            patch_jump(jit, kept);
+            emit_load_eax(jit, rb);
+            emit_bytes(jit, (const uint8_t[]){ 0x31, 0xd2, 0xf7, 0xf1 }, 4);
+            emit_store_eax(jit, ra);
+            patch_jump(jit, done);
+            break;
+        case NAND:
+            emit_load_eax(jit, rb);
+            emit_op_eax(jit, 0, 0x23, rc);
+            emit_byte(jit, 0xf7);       /* not eax */
+            emit_byte(jit, 0xd0);
+            emit_store_eax(jit, ra);
+            break;
+        case LV:
+            /* mov dword [rbx + 4ra], value */
+            lv_reg = (word >> LV_RA_LSB) & R_MASK;
+            lv_value = word & LV_VALUE_MASK;
+            emit_byte(jit, 0xc7);
+            emit_byte(jit, 0x43);
+            emit_byte(jit, lv_reg * 4);
+            emit_u32(jit, lv_value);
+            break;
+        case SLOAD:
+            /* mov edx, [rc]; probe against len; mov eax, [rcx + 4rdx];
+               otherwise the helper */
+            emit_load_eax(jit, rb);
+            emit_byte(jit, 0x8b);
+            emit_byte(jit, 0x53);
+            emit_byte(jit, rc * 4);
+            emit_probe(jit, offsetof(Segment, len), slow);
+            emit_bytes(jit, (const uint8_t[]){ 0x8b, 0x04, 0x91 }, 3);
+            emit_store_eax(jit, ra);
+            done = emit_jump8(jit, 0xeb);
+            patch_jump(jit, slow[0]);
+            patch_jump(jit, slow[1]);
+            emit_call(jit, (void *)(uintptr_t)jit_sload, ra, rb, rc);
+            patch_jump(jit, done);
+            break;
+        case SSTORE:
+            /* mov edx, [rb]; probe against store_len, which is 0 for
+               segment 0 and shared storage; mov [rcx + 4rdx], [rc].
+               Otherwise the helper and, if that dropped blocks, on to
+               whatever is left at pc through lookup */
+            emit_load_eax(jit, ra);
+            emit_byte(jit, 0x8b);
+            emit_byte(jit, 0x53);
+            emit_byte(jit, rb * 4);
+            emit_probe(jit, offsetof(Segment, store_len), slow);
+            emit_load_eax(jit, rc);
+            emit_bytes(jit, (const uint8_t[]){ 0x89, 0x04, 0x91 }, 3);
+            done = emit_jump8(jit, 0xeb);
+            patch_jump(jit, slow[0]);
+            patch_jump(jit, slow[1]);
+            emit_call(jit, (void *)(uintptr_t)jit_sstore, ra, rb, rc);
+            emit_byte(jit, 0x85);       /* test eax, eax */
+            emit_byte(jit, 0xc0);
+            kept = emit_jump8(jit, 0x74);
+            emit_byte(jit, 0xb8);
+            emit_u32(jit, pc);
+            emit_jump32(jit, 0xe9, jit->lookup);
+            patch_jump(jit, kept);
+            patch_jump(jit, done);
+            break;
+        case MAP:
+            emit_call(jit, (void *)(uintptr_t)jit_map, ra, rb, rc);
+            break;
+        case UNMAP:
+            emit_call(jit, (void *)(uintptr_t)jit_unmap, ra, rb, rc);
+            break;
+        case OUT:
+            emit_call(jit, (void *)(uintptr_t)jit_out, ra, rb, rc);
+            break;
+        case IN:
+            emit_call(jit, (void *)(uintptr_t)jit_in, ra, rb, rc);
+            break;
+        case HALT:
+            emit_call(jit, (void *)(uintptr_t)jit_halt, ra, rb, rc);
+            ended = 1;
+            break;
+        case LOADP:
+            /* cmp dword [rb], 0; je over an exit at this LOADP, which
+               leaves another segment to jit_execute */
+            emit_byte(jit, 0x83);
+            emit_byte(jit, 0x7b);
+            emit_byte(jit, rb * 4);
+            emit_byte(jit, 0x00);
+            kept = emit_jump8(jit, 0x74);
+            emit_exit(jit, pc - 1);
+            patch_jump(jit, kept);
+
+            /* Segment zero: on to the target, straight through its table
+               entry when the LV just before set it */
+            if (prev_lv_reg == (int)rc && lv_value <= jit->len) {
+                emit_goto(jit, lv_value);
+            } else {
+                emit_load_eax(jit, rc);
+                emit_jump32(jit, 0xe9, jit->lookup);
+            }
+            ended = 1;
+            break;
+        default:
+            emit_call(jit, (void *)(uintptr_t)jit_invalid, ra, rb, rc);
+            ended = 1;
+            break;
+        }
+
+        assert(jit->used - before <= JIT_MAX_INSTRUCTION_BYTES);
+    }
+
+    if (!ended) {
+        emit_goto(jit, pc);
+    }
+
+    jit_protect(jit, first, jit->used, PROT_READ | PROT_EXEC);
+
+    jit->entry[start] = block;
+    jit->span[start] = pc - start;
+
+    return block;
+}
+
+/* Name: jit_execute
+ * Input: a UM_T struct
+ * Output: N/A
+ * Does: Executes all instructions in segment zero until there is no
+ *       instruction left or until there is a halt instruction, running
+ *       translated blocks, translating missing ones, and handling LOADP
+ *       of segments other than zero
+ * Error: Asserts if UM_T struct is NULL
+ *        Asserts if the code region cannot be mapped
+ * Notes: falls back to um_execute on hosts other than x86-64
+ */
+void jit_execute(UM_T um)
+{
+    assert(um != NULL);
+
+#if !defined(__x86_64__)
+    um_execute(um);
+#else
+    struct Jit_T jit;
+
+    memset(&jit, 0, sizeof(jit));
+    jit.um = um;
+    jit.mem = um->mem;
+
+    jit.code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(jit.code != MAP_FAILED);
+    jit_emit_stubs(&jit);
+    jit_protect(&jit, 0, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+
+    jit_reset(&jit);
+
+    uint32_t pc = 0;
+    while (pc < jit.len) {
+        uint32_t word = memory_get(um->mem, 0, pc);
+        uint32_t rb = (word >> RB_LSB) & R_MASK;
+
+        if ((word >> OP_LSB) == LOADP && um->regs[rb] != 0) {
+            const uint32_t *old = um->mem->segments[0].data;
+
+            pc = load_program(um, (word >> RA_LSB) & R_MASK, rb,
+                              (word >> RC_LSB) & R_MASK);
+
+            /* A new segment zero invalidates every block */
+            if (um->mem->segments[0].data != old) {
+                jit_reset(&jit);
+            }
+            continue;
+        }
+
+        uint8_t *block = jit.entry[pc];
+        if (block == NULL) {
+            block = jit_compile(&jit, pc);
+        }
+        pc = jit.enter(um->regs, &jit, block);
+    }
+
+    munmap(jit.code, JIT_CODE_SIZE);
+    jit_free_tables(&jit);
+#endif
+}
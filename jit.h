@@ -0,0 +1,14 @@
+/*
+ * Interface for the x86-64 baseline JIT of the UM implementation
+ *
+ */
+
+#include "um.h"
+
+#ifndef JIT_H_
+#define JIT_H_
+
+/* Executes passed in program, translating segment zero to native code */
+void jit_execute(UM_T um);
+
+#endif
@@ -0,0 +1,576 @@
+/*
+ * Implementation of the UM program loader. The .um file is mapped with
+ * mmap and its big-endian words are converted to host order straight
+ * into segment zero's storage, 32 bytes at a time with an AVX2 byte
+ * shuffle when the CPU has it, otherwise 16 at a time with SSE2 (part of
+ * every x86-64), with a scalar loop for the tail and for other hosts.
+ * Loading is then bounded by memory bandwidth rather than by a stdio call
+ * per byte.
+ * A native image (see loader.h) needs no conversion at all: its private
+ * mapping becomes segment zero as it is, so only the pages the program
+ * touches are ever read.
+ * um_stream instead has a thread read the program into segment zero a
+ * chunk at a time while it runs, for pipes and slow storage; the
+ * interpreter only waits when it gets ahead of the data (see
+ * memory_await_zero).
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "loader.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define LOADER_SIMD 1
+#endif
+
+#define CHAR_PER_WORD 4
+
+/* Bytes a streaming load reads at a time, and the most it can read from
+   a pipe: every word a segment can have */
+#define STREAM_CHUNK (1 << 20)
+#define STREAM_MAX_BYTES ((size_t)UINT32_MAX * CHAR_PER_WORD)
+
+/* A streaming load: the Zero_stream that segment zero waits on, the
+   file it reads, the mapping it fills and how many bytes were already in
+   it when the thread started, and, under lock, how many words have
+   arrived (converted to host order), whether the load is over, and the
+   errno of the read that failed, if one did */
+typedef struct Stream {
+    Zero_stream base;
+    int fd;
+    uint8_t *map;
+    size_t capacity;
+    size_t start;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    uint32_t words;
+    int done;
+    int error;
+} Stream;
+
+#ifdef LOADER_SIMD
+/* Name: swap_avx2
+ * Input: destination words, source bytes and a word count
+ * Output: how many words were converted (a multiple of 8)
+ */
+__attribute__((target("avx2")))
+static size_t swap_avx2(uint32_t *dst, const uint8_t *src, size_t count)
+{
+    const __m256i reverse = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                             11, 10, 9, 8, 15, 14, 13, 12,
+                                             3, 2, 1, 0, 7, 6, 5, 4,
+                                             11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_shuffle_epi8(v, reverse));
+    }
+
+    return i;
+}
+
+/* Name: swap_sse2
+ * Input: destination words, source bytes and a word count
+ * Output: how many words were converted (a multiple of 4)
+ * Notes: SSE2 has no byte shuffle, so each word has its 16-bit halves
+ *        swapped and then the bytes of each half
+ */
+static size_t swap_sse2(uint32_t *dst, const uint8_t *src, size_t count)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+
+    return i;
+}
+#endif
+
+/* Name: um_swap_words
+ * Input: destination words, source bytes and a word count
+ * Output: N/A
+ * Does: Stores each big-endian 4-byte group of src as a host order word
+ */
+void um_swap_words(uint32_t *dst, const uint8_t *src, size_t count)
+{
+    size_t i = 0;
+
+#ifdef LOADER_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        i = swap_avx2(dst, src, count);
+    } else {
+        i = swap_sse2(dst, src, count);
+    }
+#endif
+
+    /* Compilers turn this into a load and a bswap */
+    for (; i < count; i++) {
+        const uint8_t *b = src + i * CHAR_PER_WORD;
+        dst[i] = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 |
+                 (uint32_t)b[2] << 8 | b[3];
+    }
+}
+
+/* Name: map_fd
+ * Input: an open file and a pointer to receive its size in bytes
+ * Output: a private, writable mapping of the file, or NULL on failure
+ * Notes: an empty file maps to a non-NULL pointer with size 0
+ */
+static uint8_t *map_fd(int fd, size_t *bytes)
+{
+    static uint8_t empty[1];
+
+    struct stat file_info;
+    if (fstat(fd, &file_info) != 0) {
+        return NULL;
+    }
+
+    *bytes = file_info.st_size;
+    if (*bytes == 0) {
+        return empty;
+    }
+
+    void *file = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      fd, 0);
+    if (file == MAP_FAILED) {
+        return NULL;
+    }
+
+    return file;
+}
+
+/* Name: map_file
+ * Input: a path and a pointer to receive the file size in bytes
+ * Output: as map_fd
+ */
+static uint8_t *map_file(const char *path, size_t *bytes)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    uint8_t *file = map_fd(fd, bytes);
+    close(fd);
+
+    return file;
+}
+
+/* Name: unmap_file
+ * Input: a mapping from map_file and its size
+ * Output: N/A
+ */
+static void unmap_file(uint8_t *file, size_t bytes)
+{
+    if (bytes != 0) {
+        munmap(file, bytes);
+    }
+}
+
+/* Name: image_words
+ * Input: a mapped file, its size, and pointers to receive segment zero's
+ *        words and their count
+ * Output: 1 for a native image, 0 for a .um file, -1 (with errno set to
+ *         ENOEXEC) for an image that is truncated or was made on a host
+ *         with the other byte order
+ */
+static int image_words(uint8_t *file, size_t bytes, uint32_t **words,
+                       uint32_t *count)
+{
+    const Um_image_header *header = (const void *)file;
+
+    if (bytes < sizeof(*header) ||
+        memcmp(header->magic, UM_IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+        return 0;
+    }
+
+    /* Every section has to lie inside the file, known tag or not */
+    size_t end = sizeof(*header) + (size_t)header->words * sizeof(uint32_t);
+    for (uint32_t s = 0; s < header->sections && end <= bytes; s++) {
+        const Um_image_section *section = (const void *)(file + end);
+        end += sizeof(*section);
+        if (end <= bytes) {
+            end += (size_t)section->words * sizeof(uint32_t);
+        }
+    }
+
+    if (header->byte_order != UM_IMAGE_BYTE_ORDER || end > bytes) {
+        errno = ENOEXEC;
+        return -1;
+    }
+
+    *words = (uint32_t *)(file + sizeof(*header));
+    *count = header->words;
+
+    return 1;
+}
+
+/* Name: load_mapped
+ * Input: a mapping from map_fd and its size
+ * Output: a new UM_T ready to run the program in it, or NULL if it is
+ *         an image this host cannot run
+ * Does: For a native image, hands the mapping to segment zero with
+ *       memory_adopt_zero. For a .um file, sizes segment zero to the
+ *       whole words in the file and fills it directly, without going
+ *       through memory_put
+ */
+static UM_T load_mapped(uint8_t *file, size_t bytes)
+{
+    uint32_t *words;
+    uint32_t size;
+    int image = image_words(file, bytes, &words, &size);
+    if (image < 0) {
+        unmap_file(file, bytes);
+        return NULL;
+    }
+
+    if (image) {
+        UM_T um = um_new(0);
+        memory_adopt_zero(um->mem, file, bytes, words, size);
+        return um;
+    }
+
+    madvise(file, bytes, MADV_SEQUENTIAL);
+    size = bytes / CHAR_PER_WORD;
+    UM_T um = um_new(size);
+
+    um_swap_words(um->mem->segments[0].data, file, size);
+    unmap_file(file, bytes);
+
+    return um;
+}
+
+/* Name: um_load
+ * Input: the path of a .um file or native image
+ * Output: a new UM_T ready to run the program, or NULL if the file
+ *         cannot be read or is an image this host cannot run
+ */
+UM_T um_load(const char *path)
+{
+    size_t bytes;
+    uint8_t *file = map_file(path, &bytes);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    return load_mapped(file, bytes);
+}
+
+/* Name: stream_publish
+ * Input: a Stream, how many bytes are in its mapping, and how many words
+ *        of them are already in host order
+ * Output: the new count of words in host order
+ * Does: Converts the words that became whole and publishes the count;
+ *       a word split across reads is converted once it is whole
+ */
+static uint32_t stream_publish(Stream *s, size_t got, uint32_t swapped)
+{
+    uint32_t words = got / CHAR_PER_WORD;
+    um_swap_words((uint32_t *)s->map + swapped,
+                  s->map + (size_t)swapped * CHAR_PER_WORD,
+                  words - swapped);
+
+    pthread_mutex_lock(&s->lock);
+    s->words = words;
+    pthread_cond_broadcast(&s->more);
+    pthread_mutex_unlock(&s->lock);
+
+    return words;
+}
+
+/* Name: stream_run
+ * Input: the Stream to fill
+ * Output: NULL
+ * Does: The loader thread: reads the file into the mapping, after the
+ *       bytes um_stream already put there, until end of file or until
+ *       the mapping is full, publishing the words after every read
+ */
+static void *stream_run(void *arg)
+{
+    Stream *s = arg;
+    size_t got = s->start;
+    uint32_t swapped = 0;
+
+    if (got > 0) {
+        swapped = stream_publish(s, got, swapped);
+    }
+
+    for (;;) {
+        size_t want = s->capacity - got;
+        if (want > STREAM_CHUNK) {
+            want = STREAM_CHUNK;
+        }
+
+        ssize_t n = want == 0 ? 0 : read(s->fd, s->map + got, want);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            pthread_mutex_lock(&s->lock);
+            s->error = n < 0 ? errno : 0;
+            s->done = 1;
+            pthread_cond_broadcast(&s->more);
+            pthread_mutex_unlock(&s->lock);
+            return NULL;
+        }
+
+        got += n;
+        swapped = stream_publish(s, got, swapped);
+    }
+}
+
+/* Name: read_full
+ * Input: an open file, a buffer and its size
+ * Output: how many bytes were read: all of them unless the file ended
+ *         first, or -1 (with errno set) if a read failed
+ */
+static ssize_t read_full(int fd, uint8_t *buf, size_t bytes)
+{
+    size_t got = 0;
+
+    while (got < bytes) {
+        ssize_t n = read(fd, buf + got, bytes - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        got += n;
+    }
+
+    return got;
+}
+
+/* Name: load_piped_image
+ * Input: a file that is not a regular file, positioned after the header
+ *        of a native image, and a mapping of map_bytes bytes holding the
+ *        header, as um_stream makes it
+ * Output: as load_mapped, or NULL (with errno set) if a read fails
+ * Does: Reads the rest of the image into the mapping and trims the
+ *       mapping to it; an image cannot run before all of it has arrived
+ */
+static UM_T load_piped_image(int fd, uint8_t *map, size_t map_bytes)
+{
+    size_t got = sizeof(Um_image_header);
+    ssize_t n = read_full(fd, map + got, map_bytes - got);
+    if (n < 0) {
+        munmap(map, map_bytes);
+        return NULL;
+    }
+    got += n;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t kept = (got + page - 1) / page * page;
+    if (kept < map_bytes) {
+        munmap(map + kept, map_bytes - kept);
+    }
+
+    return load_mapped(map, got);
+}
+
+/* Name: stream_wait
+ * Input: a Stream and a number of words
+ * Output: how many words have arrived: at least "words" unless the load
+ *         is over
+ * Error: A failed read is a UM fault
+ */
+static uint32_t stream_wait(Zero_stream *stream, uint32_t words)
+{
+    Stream *s = (Stream *)stream;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->words < words && !s->done) {
+        pthread_cond_wait(&s->more, &s->lock);
+    }
+    uint32_t arrived = s->words;
+    int error = s->error;
+    pthread_mutex_unlock(&s->lock);
+
+    if (error != 0) {
+        um_fault(strerror(error));
+    }
+
+    return arrived;
+}
+
+/* Name: stream_close
+ * Input: a Stream
+ * Output: N/A
+ * Does: Stops the loader thread if it is still reading (read is a
+ *       cancellation point, and the thread holds the lock only around
+ *       calls that are not), then frees the stream but not the mapping,
+ *       which belongs to segment zero
+ */
+static void stream_close(Zero_stream *stream)
+{
+    Stream *s = (Stream *)stream;
+
+    pthread_cancel(s->thread);
+    pthread_join(s->thread, NULL);
+    if (s->fd != STDIN_FILENO) {
+        close(s->fd);
+    }
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->more);
+    free(s);
+}
+
+/* Name: um_stream
+ * Input: the path of a .um file, or "-" for standard input
+ * Output: a new UM_T whose segment zero fills in while it runs, or NULL
+ *         (with errno set) if the file cannot be opened or the loader
+ *         thread cannot be started
+ * Does: Starts a loader thread filling an anonymous mapping, sized to
+ *       the file when it is a regular file and otherwise to the largest
+ *       possible segment (MAP_NORESERVE, so only pages that data arrives
+ *       in use memory). A native image is mapped as um_load does, since
+ *       that is already instant; one on a pipe is read in whole first
+ */
+UM_T um_stream(const char *path)
+{
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat file_info;
+    size_t capacity = STREAM_MAX_BYTES;
+    int regular = fstat(fd, &file_info) == 0 && S_ISREG(file_info.st_mode);
+    if (regular) {
+        Um_image_header header;
+        if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+            memcmp(header.magic, UM_IMAGE_MAGIC,
+                   sizeof(header.magic)) == 0) {
+            size_t bytes;
+            uint8_t *file = map_fd(fd, &bytes);
+            if (fd != STDIN_FILENO) {
+                close(fd);
+            }
+            return file == NULL ? NULL : load_mapped(file, bytes);
+        }
+        capacity = file_info.st_size;
+    }
+
+    /* At least one page, so that an empty file still maps */
+    size_t map_bytes = capacity > 0 ? capacity : 1;
+    void *map = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    /* On a pipe, the image magic is only seen by reading it */
+    size_t start = 0;
+    if (!regular) {
+        const Um_image_header *header = map;
+        ssize_t n = read_full(fd, map, sizeof(*header));
+        int image = n == sizeof(*header) &&
+                    memcmp(header->magic, UM_IMAGE_MAGIC,
+                           sizeof(header->magic)) == 0;
+
+        if (n < 0 || image) {
+            UM_T um = NULL;
+            if (image) {
+                um = load_piped_image(fd, map, map_bytes);
+            } else {
+                munmap(map, map_bytes);
+            }
+            if (fd != STDIN_FILENO) {
+                close(fd);
+            }
+            return um;
+        }
+        start = n;
+    }
+
+    Stream *s = malloc(sizeof(*s));
+    assert(s != NULL);
+    s->base.wait = stream_wait;
+    s->base.close = stream_close;
+    s->fd = fd;
+    s->map = map;
+    s->capacity = capacity;
+    s->start = start;
+    s->words = 0;
+    s->done = 0;
+    s->error = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->more, NULL);
+
+    int err = pthread_create(&s->thread, NULL, stream_run, s);
+    if (err != 0) {
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->more);
+        free(s);
+        munmap(map, map_bytes);
+        if (fd != STDIN_FILENO) {
+            close(fd);
+        }
+        errno = err;
+        return NULL;
+    }
+
+    UM_T um = um_new(0);
+    memory_stream_zero(um->mem, map, map_bytes, &s->base);
+
+    return um;
+}
+
+/* Name: um_load_words
+ * Input: the path of a .um file or native image and a pointer to
+ *        receive the word count
+ * Output: a malloc'd array of the program's words in host order (with
+ *         one spare entry, so it is never empty), or NULL if the file
+ *         cannot be read or is an image this host cannot run
+ */
+uint32_t *um_load_words(const char *path, uint32_t *count)
+{
+    size_t bytes;
+    uint8_t *file = map_file(path, &bytes);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    uint32_t *image;
+    int is_image = image_words(file, bytes, &image, count);
+    if (is_image < 0) {
+        unmap_file(file, bytes);
+        return NULL;
+    }
+    if (!is_image) {
+        *count = bytes / CHAR_PER_WORD;
+    }
+
+    uint32_t *words = malloc(((size_t)*count + 1) * sizeof(*words));
+    if (words != NULL && is_image) {
+        memcpy(words, image, (size_t)*count * sizeof(*words));
+    } else if (words != NULL) {
+        um_swap_words(words, file, *count);
+    }
+    unmap_file(file, bytes);
+
+    return words;
+}
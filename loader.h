@@ -0,0 +1,56 @@
+/*
+ * Interface for the program loader of the UM implementation
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "um.h"
+
+#ifndef LOADER_H_
+#define LOADER_H_
+
+/* A native image (see umimage.c) is this header, "words" host order
+   words of segment zero, then "sections" optional sections, each a
+   Um_image_section followed by its "words" words. Sections carry
+   metadata or precomputed data; loaders skip tags they do not know */
+#define UM_IMAGE_MAGIC "\177UMIMG\r\n"
+#define UM_IMAGE_BYTE_ORDER 0x01020304
+
+/* Section tags: UM_IMAGE_SOURCE holds the name of the .um file the image
+   was made from, NUL padded to whole words */
+#define UM_IMAGE_SOURCE 1
+
+typedef struct Um_image_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t words;
+    uint32_t sections;
+    uint32_t reserved;
+} Um_image_header;
+
+typedef struct Um_image_section {
+    uint32_t tag;
+    uint32_t words;
+} Um_image_section;
+
+/* Creates a UM_T whose segment zero holds the program at path, a .um
+   file or a native image, or returns NULL (with errno set) if the file
+   cannot be read or is an image made for a different byte order */
+UM_T um_load(const char *path);
+
+/* Like um_load, but segment zero of a .um file is read in by a loader
+   thread while the program runs, so it starts on the first chunk; "-"
+   reads standard input, which may also hold a native image. NULL (with
+   errno set) if it cannot start */
+UM_T um_stream(const char *path);
+
+/* Reads the program at path, in either format, into a malloc'd array of
+   host order words, storing how many there are in *count; NULL if it
+   cannot */
+uint32_t *um_load_words(const char *path, uint32_t *count);
+
+/* Converts count big-endian words at src into host order at dst */
+void um_swap_words(uint32_t *dst, const uint8_t *src, size_t count);
+
+#endif
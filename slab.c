@@ -0,0 +1,404 @@
+/*
+ * Implementation of the segment storage allocator for the UM. Segments of
+ * up to 2^SLAB_MAX_CLASS words are rounded up to a power of two size
+ * class and carved out of 1 MB slabs, one slab at a time per class;
+ * released blocks go on a free list for their class and are handed out
+ * again before any new slab space. Slabs come from mmap, so fresh blocks
+ * are already zero and only reused ones are cleared.
+ *
+ * Larger segments get an anonymous mmap of their own, never reused, so
+ * the spec's all-zero start costs nothing: every page reads as the
+ * kernel's shared zero page until the UM program first writes to it.
+ * A sparsely used array only takes memory for the pages it touches.
+ *
+ * Releasing a block of at least release_words words hands its physical
+ * pages back to the kernel: an oversized mapping is unmapped, and a size
+ * class block has every page after its first dropped with MADV_DONTNEED
+ * (the first keeps the free list link). Dropped pages read as zero
+ * again, so reusing such a block only clears its first page.
+ *
+ * The Slab_T owns all of this storage: oversized mappings are linked
+ * through a small header in front of their words, so slab_free tears
+ * everything down with one munmap per slab or oversized block, however
+ * many segments were carved out of them.
+ *
+ * With a spill file set, every slab and oversized block mapped once the
+ * allocator has spill_after bytes of anonymous storage is instead a
+ * MAP_SHARED window onto a new stretch at the end of a sparse file. The
+ * kernel can then write cold segments back to the file and drop their
+ * pages under memory pressure, rather than swapping or killing the
+ * process. A file grown with ftruncate reads as zero just like fresh
+ * anonymous memory; dropping pages punches holes with MADV_REMOVE, so
+ * they read as zero again and the file stays sparse.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "slab.h"
+
+/* Smallest class holds 2 words: room for the free list link */
+#define SLAB_MIN_CLASS 1
+/* 4096 words: 4 pages, above which clearing a reused block costs more
+   than mapping fresh zero pages */
+#define SLAB_MAX_CLASS 12
+#define SLAB_BYTES (1024 * 1024)
+#define SLAB_RELEASE_WORDS (1u << SLAB_MAX_CLASS)
+/* Initial room in the table of slabs */
+#define SLAB_TABLE_HINT 10
+
+/* A released block, linked through its first bytes */
+typedef struct Slab_block {
+    struct Slab_block *next;
+} Slab_block;
+
+/* The header in front of an oversized block, linking all of them */
+typedef struct Slab_big {
+    struct Slab_big *prev;
+    struct Slab_big *next;
+    size_t bytes;
+} Slab_big;
+
+/* Struct definition of a Slab_T which contains, for every size class:
+   - the free list of released blocks
+   - the unused tail of the class's current slab and its size in bytes
+   and a growable array of every slab and a list of every oversized
+   block, so they can all be unmapped
+   and the page size, the smallest block size whose pages are given back
+   on release, and how many bytes have been given back so far
+   and the spill file (-1 for none), how much of it is in use, and how
+   many bytes of anonymous storage to map before using it */
+struct Slab_T {
+    Slab_block *free[SLAB_MAX_CLASS + 1];
+    uint8_t *next[SLAB_MAX_CLASS + 1];
+    size_t left[SLAB_MAX_CLASS + 1];
+    void **slabs;
+    uint32_t slab_count;
+    uint32_t slab_cap;
+    Slab_big *big;
+    size_t page_bytes;
+    uint32_t release_words;
+    uint64_t returned;
+    int spill_fd;
+    off_t spill_bytes;
+    size_t anon_bytes;
+    size_t spill_after;
+};
+
+/* Name: size_class
+ * Input: a segment length in words
+ * Output: the smallest class whose 2^class words hold length words
+ */
+static inline uint32_t size_class(uint32_t length)
+{
+    if (length <= (1u << SLAB_MIN_CLASS)) {
+        return SLAB_MIN_CLASS;
+    }
+
+    return 32 - __builtin_clz(length - 1);
+}
+
+/* Name: drops_pages
+ * Input: a Slab_T and a size class
+ * Output: 1 if released blocks of this class have all pages after their
+ *         first dropped, otherwise 0
+ */
+static inline int drops_pages(Slab_T slab, uint32_t class)
+{
+    size_t bytes = sizeof(uint32_t) << class;
+
+    return (1u << class) >= slab->release_words && bytes > slab->page_bytes;
+}
+
+/* Name: map_zeroed
+ * Input: a Slab_T and a size in bytes
+ * Output: a fresh mapping of that size, all zero
+ * Does: Maps private anonymous memory, or once spilling has started, a
+ *       new page-aligned stretch at the end of the spill file
+ * Error: Asserts if the mapping fails or the file cannot grow
+ * Notes: MAP_NORESERVE leaves pages that are never written uncharged, so
+ *        a huge sparse segment does not trip strict overcommit
+ */
+static void *map_zeroed(Slab_T slab, size_t bytes)
+{
+    void *p;
+
+    if (slab->spill_fd < 0 || slab->anon_bytes < slab->spill_after) {
+        p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        assert(p != MAP_FAILED);
+        slab->anon_bytes += bytes;
+        return p;
+    }
+
+    size_t span = (bytes + slab->page_bytes - 1) & ~(slab->page_bytes - 1);
+    int grown = ftruncate(slab->spill_fd, slab->spill_bytes + span);
+    assert(grown == 0);
+
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+             slab->spill_fd, slab->spill_bytes);
+    assert(p != MAP_FAILED);
+    slab->spill_bytes += span;
+
+    return p;
+}
+
+/* Name: drop_pages
+ * Input: a Slab_T and a page-aligned range of storage
+ * Output: 1 if the pages went back to the kernel, otherwise 0
+ * Does: Frees the range's pages so it reads as zero again: punching a
+ *       hole in the spill file, or dropping anonymous pages. If the file
+ *       system cannot punch holes, the range is cleared in place instead
+ */
+static int drop_pages(Slab_T slab, void *p, size_t bytes)
+{
+    if (slab->spill_fd >= 0) {
+        if (madvise(p, bytes, MADV_REMOVE) == 0) {
+            return 1;
+        }
+
+        /* Not a file mapping: storage mapped before spilling started */
+        if (errno != EINVAL) {
+            memset(p, 0, bytes);
+            return 0;
+        }
+    }
+
+    madvise(p, bytes, MADV_DONTNEED);
+    return 1;
+}
+
+/* Name: slab_new
+ * Input: N/A
+ * Output: a newly allocated Slab_T with no slabs yet
+ * Error: Asserts if memory is not allocated
+ */
+Slab_T slab_new(void)
+{
+    Slab_T slab = calloc(1, sizeof(*slab));
+    assert(slab != NULL);
+
+    slab->slabs = malloc(SLAB_TABLE_HINT * sizeof(*slab->slabs));
+    assert(slab->slabs != NULL);
+    slab->slab_cap = SLAB_TABLE_HINT;
+
+    slab->page_bytes = sysconf(_SC_PAGESIZE);
+    slab->release_words = SLAB_RELEASE_WORDS;
+    slab->spill_fd = -1;
+
+    return slab;
+}
+
+/* Name: slab_free
+ * Input: a pointer to a Slab_T
+ * Output: N/A
+ * Does: Unmaps every slab and every oversized block, which frees all
+ *       blocks still handed out without visiting them one by one
+ * Error: Asserts if Slab_T is NULL
+ */
+void slab_free(Slab_T *slab)
+{
+    assert(slab != NULL && *slab != NULL);
+
+    for (uint32_t i = 0; i < (*slab)->slab_count; i++) {
+        munmap((*slab)->slabs[i], SLAB_BYTES);
+    }
+
+    Slab_big *big = (*slab)->big;
+    while (big != NULL) {
+        Slab_big *next = big->next;
+        munmap(big, big->bytes);
+        big = next;
+    }
+
+    if ((*slab)->spill_fd >= 0) {
+        close((*slab)->spill_fd);
+    }
+
+    free((*slab)->slabs);
+    free(*slab);
+    *slab = NULL;
+}
+
+/* Name: slab_alloc
+ * Input: a Slab_T and a segment length in words
+ * Output: a pointer to "length" words, all zero
+ * Does: Pops a block off the class free list and clears it, or carves a
+ *       new one from the class's slab, mapping a new slab when it is used
+ *       up; oversized lengths get a mapping of their own whose pages
+ *       stay unbacked until written
+ * Error: Asserts if memory is not allocated
+ */
+uint32_t *slab_alloc(Slab_T slab, uint32_t length)
+{
+    uint32_t class = size_class(length);
+
+    if (class > SLAB_MAX_CLASS) {
+        size_t bytes = sizeof(Slab_big) + (size_t)length * sizeof(uint32_t);
+        Slab_big *big = map_zeroed(slab, bytes);
+
+        big->bytes = bytes;
+        big->prev = NULL;
+        big->next = slab->big;
+        if (slab->big != NULL) {
+            slab->big->prev = big;
+        }
+        slab->big = big;
+
+        return (uint32_t *)(big + 1);
+    }
+
+    Slab_block *block = slab->free[class];
+    if (block != NULL) {
+        size_t dirty = (size_t)length * sizeof(uint32_t);
+
+        /* Only the first page survived the release */
+        if (drops_pages(slab, class) && dirty > slab->page_bytes) {
+            dirty = slab->page_bytes;
+        }
+
+        slab->free[class] = block->next;
+        memset(block, 0, dirty);
+        return (uint32_t *)block;
+    }
+
+    size_t bytes = sizeof(uint32_t) << class;
+    if (slab->left[class] < bytes) {
+        if (slab->slab_count == slab->slab_cap) {
+            slab->slab_cap *= 2;
+            slab->slabs = realloc(slab->slabs,
+                                  slab->slab_cap * sizeof(*slab->slabs));
+            assert(slab->slabs != NULL);
+        }
+
+        slab->next[class] = map_zeroed(slab, SLAB_BYTES);
+        slab->left[class] = SLAB_BYTES;
+        slab->slabs[slab->slab_count++] = slab->next[class];
+    }
+
+    uint32_t *words = (uint32_t *)slab->next[class];
+    slab->next[class] += bytes;
+    slab->left[class] -= bytes;
+
+    return words;
+}
+
+/* Name: slab_release
+ * Input: a Slab_T, a block from slab_alloc and the length it was
+ *        allocated with
+ * Output: N/A
+ * Does: Pushes a size class block onto its free list, or unmaps an
+ *       oversized one; a block of at least release_words words has its
+ *       pages given back to the kernel, counted in the returned bytes
+ */
+void slab_release(Slab_T slab, uint32_t *words, uint32_t length)
+{
+    uint32_t class = size_class(length);
+
+    if (class > SLAB_MAX_CLASS) {
+        Slab_big *big = (Slab_big *)words - 1;
+
+        if (big->prev != NULL) {
+            big->prev->next = big->next;
+        } else {
+            slab->big = big->next;
+        }
+        if (big->next != NULL) {
+            big->next->prev = big->prev;
+        }
+
+        /* Spilled storage must also leave the file, if it can */
+        size_t bytes = big->bytes;
+        if (slab->spill_fd >= 0) {
+            madvise(big, bytes, MADV_REMOVE);
+        }
+
+        slab->returned += bytes;
+        munmap(big, bytes);
+        return;
+    }
+
+    if (drops_pages(slab, class)) {
+        size_t bytes = (sizeof(uint32_t) << class) - slab->page_bytes;
+        if (drop_pages(slab, (uint8_t *)words + slab->page_bytes, bytes)) {
+            slab->returned += bytes;
+        }
+    }
+
+    Slab_block *block = (Slab_block *)words;
+    block->next = slab->free[class];
+    slab->free[class] = block;
+}
+
+/* Name: slab_set_release
+ * Input: a Slab_T and a block size in words
+ * Output: N/A
+ * Does: Sets the smallest size class block whose pages are given back to
+ *       the kernel on release; oversized blocks always are
+ *       Blocks already on the free list of a class that now drops pages
+ *       have theirs dropped too, since reuse relies on the threshold to
+ *       know which pages are still zero
+ */
+void slab_set_release(Slab_T slab, uint32_t words)
+{
+    int dropped[SLAB_MAX_CLASS + 1];
+
+    for (uint32_t class = SLAB_MIN_CLASS; class <= SLAB_MAX_CLASS; class++) {
+        dropped[class] = drops_pages(slab, class);
+    }
+    slab->release_words = words;
+
+    for (uint32_t class = SLAB_MIN_CLASS; class <= SLAB_MAX_CLASS; class++) {
+        if (dropped[class] || !drops_pages(slab, class)) {
+            continue;
+        }
+
+        size_t bytes = (sizeof(uint32_t) << class) - slab->page_bytes;
+        for (Slab_block *block = slab->free[class]; block != NULL;
+             block = block->next) {
+            if (drop_pages(slab, (uint8_t *)block + slab->page_bytes,
+                           bytes)) {
+                slab->returned += bytes;
+            }
+        }
+    }
+}
+
+/* Name: slab_returned
+ * Input: a Slab_T
+ * Output: the number of bytes given back to the kernel so far
+ */
+uint64_t slab_returned(Slab_T slab)
+{
+    return slab->returned;
+}
+
+/* Name: slab_set_spill
+ * Input: a Slab_T, the path of a file to create and a size in bytes
+ * Output: 0 on success, -1 if the file cannot be created
+ * Does: Creates (or truncates) the spill file and unlinks it, so it goes
+ *       away with the process; storage mapped after the allocator holds
+ *       "after" bytes of anonymous storage comes from the file
+ */
+int slab_set_spill(Slab_T slab, const char *path, size_t after)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+
+    if (slab->spill_fd >= 0) {
+        close(slab->spill_fd);
+    }
+    slab->spill_fd = fd;
+    slab->spill_bytes = 0;
+    slab->spill_after = after;
+
+    return 0;
+}
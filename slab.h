@@ -0,0 +1,35 @@
+/*
+ * Interface for the segment storage allocator of the UM implementation
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef SLAB_H_
+#define SLAB_H_
+
+/* Pointer to a struct that contains the data structure for this module */
+typedef struct Slab_T *Slab_T;
+
+/* Creates and frees an allocator; freeing it releases every block it has
+   handed out, at a cost that does not depend on how many there are */
+Slab_T slab_new(void);
+void slab_free(Slab_T *slab);
+
+/* Hands out "length" zeroed words, and takes them back; the length given
+   to slab_release must be the one they were allocated with */
+uint32_t *slab_alloc(Slab_T slab, uint32_t length);
+void slab_release(Slab_T slab, uint32_t *words, uint32_t length);
+
+/* Blocks of at least "words" words give their pages back to the kernel
+   on release, including those already released; slab_returned counts
+   the bytes given back */
+void slab_set_release(Slab_T slab, uint32_t words);
+uint64_t slab_returned(Slab_T slab);
+
+/* Backs storage mapped once "after" bytes are in use with a sparse file
+   at path instead of anonymous memory; returns -1 if it cannot be made */
+int slab_set_spill(Slab_T slab, const char *path, size_t after);
+
+#endif
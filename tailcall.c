@@ -0,0 +1,237 @@
+/*
+ * Implementation of the tail-call-threaded UM engine. Every opcode has its
+ * own handler function which, once done, fetches the next word of segment
+ * zero and tail calls that word's handler through a 16 entry table. The
+ * machine state (UM_T, register array, segment zero base and length,
+ * program counter and current word) travels in argument registers, so it
+ * stays in host registers for the whole run and every handler gets its own
+ * indirect branch. Selected with --tailcall, next to um_execute and the JIT.
+ * A compiler that can neither guarantee tail calls nor is optimizing
+ * (as in a -O0 debug build) would grow the stack by a frame per
+ * instruction, so there the handlers return to a dispatch loop instead.
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "um.h"
+#include "tailcall.h"
+
+/* Guarantees the tail call where the compiler supports it; otherwise the
+   -O2 sibling call optimization does the same job, and without either
+   TAIL_LOOP makes the handlers return to tail_execute */
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+#ifndef MUSTTAIL
+#define MUSTTAIL
+#ifndef __OPTIMIZE__
+#define TAIL_LOOP
+#endif
+#endif
+
+/* Every handler has this signature; the result is always 0 and only
+   exists so handlers can be written as "return next(...)", except under
+   TAIL_LOOP, where it is 1 to go on at tail_next */
+#define TAIL_PARAMS UM_T um, uint32_t *regs, const uint32_t *seg0, \
+                    uint32_t len, uint32_t pc, uint32_t word
+typedef int Tail_handler(TAIL_PARAMS);
+
+static Tail_handler *const tail_table[1 << 4];
+
+#ifdef TAIL_LOOP
+/* The index of the next word, handed from a handler to tail_execute */
+static uint32_t tail_next;
+
+#define TAIL_DISPATCH(next_pc)                                          \
+    do {                                                                \
+        (void)um;                                                       \
+        (void)regs;                                                     \
+        (void)seg0;                                                     \
+        (void)len;                                                      \
+        tail_next = (next_pc);                                          \
+        return 1;                                                       \
+    } while (0)
+#else
+/* Tail calls the handler for the word at index next_pc, or returns if
+   execution has run off the end of segment zero */
+#define TAIL_DISPATCH(next_pc)                                          \
+    do {                                                                \
+        uint32_t pc_ = (next_pc);                                       \
+        if (pc_ >= len) {                                               \
+            return 0;                                                   \
+        }                                                               \
+        uint32_t word_ = seg0[pc_];                                     \
+        MUSTTAIL return tail_table[word_ >> OP_LSB](um, regs, seg0,     \
+                                                    len, pc_, word_);   \
+    } while (0)
+#endif
+
+#define RA ((word >> RA_LSB) & R_MASK)
+#define RB ((word >> RB_LSB) & R_MASK)
+#define RC ((word >> RC_LSB) & R_MASK)
+
+/* Name: seg_zero_words
+ * Input: a UM_T struct and a pointer to receive the length
+ * Output: the base of segment zero's words
+ */
+static const uint32_t *seg_zero_words(UM_T um, uint32_t *len)
+{
+    *len = um->mem->segments[0].len;
+
+    return um->mem->segments[0].data;
+}
+
+static int tail_cmov(TAIL_PARAMS)
+{
+    if (regs[RC] != 0) {
+        regs[RA] = regs[RB];
+    }
+    TAIL_DISPATCH(pc + 1);
+}
+
+static int tail_sload(TAIL_PARAMS)
+{
+    segmented_load(um, RA, RB, RC);
+    TAIL_DISPATCH(pc + 1);
+}
+
+/* SSTORE, MAP and UNMAP reload segment zero afterwards: a store into
+   any segment that shares storage with it (through LOADP or --dedup),
+   or unmapping one, may give segment zero a copy of its own */
+static int tail_sstore(TAIL_PARAMS)
+{
+    segmented_store(um, RA, RB, RC);
+    seg0 = seg_zero_words(um, &len);
+    TAIL_DISPATCH(pc + 1);
+}
+
+static int tail_add(TAIL_PARAMS)
+{
+    regs[RA] = regs[RB] + regs[RC];
+    TAIL_DISPATCH(pc + 1);
+}
+
+static int tail_mul(TAIL_PARAMS)
+{
+    regs[RA] = regs[RB] * regs[RC];
+    TAIL_DISPATCH(pc + 1);
+}
+
+static int tail_div(TAIL_PARAMS)
+{
+    divide(um, RA, RB, RC);
+    TAIL_DISPATCH(pc + 1);
+}
+
+static int tail_nand(TAIL_PARAMS)
+{
+    regs[RA] = ~(regs[RB] & regs[RC]);
+    TAIL_DISPATCH(pc + 1);
+}
+
+static int tail_halt(TAIL_PARAMS)
+{
+    (void)regs;
+    (void)seg0;
+    (void)len;
+    (void)pc;
+    halt(um, RA, RB, RC);
+    return 0;
+}
+
+static int tail_map(TAIL_PARAMS)
+{
+    map_segment(um, RA, RB, RC);
+    seg0 = seg_zero_words(um, &len);
+    TAIL_DISPATCH(pc + 1);
+}
+
+static int tail_unmap(TAIL_PARAMS)
+{
+    unmap_segment(um, RA, RB, RC);
+    seg0 = seg_zero_words(um, &len);
+    TAIL_DISPATCH(pc + 1);
+}
+
+static int tail_out(TAIL_PARAMS)
+{
+    output(um, RA, RB, RC);
+    TAIL_DISPATCH(pc + 1);
+}
+
+static int tail_in(TAIL_PARAMS)
+{
+    input(um, RA, RB, RC);
+    TAIL_DISPATCH(pc + 1);
+}
+
+static int tail_loadp(TAIL_PARAMS)
+{
+    uint32_t next_pc = load_program(um, RA, RB, RC);
+
+    (void)pc;
+    seg0 = seg_zero_words(um, &len);
+    TAIL_DISPATCH(next_pc);
+}
+
+static int tail_lv(TAIL_PARAMS)
+{
+    regs[(word >> LV_RA_LSB) & R_MASK] = word & LV_VALUE_MASK;
+    TAIL_DISPATCH(pc + 1);
+}
+
+/* Faults even where UM_CHECK compiles to nothing */
+static int tail_invalid(TAIL_PARAMS)
+{
+    (void)um;
+    (void)regs;
+    (void)seg0;
+    (void)len;
+    (void)pc;
+    (void)word;
+    UM_CHECK(0);
+    um_fault("invalid instruction");
+}
+
+static Tail_handler *const tail_table[1 << 4] = {
+    tail_cmov, tail_sload, tail_sstore, tail_add, tail_mul, tail_div,
+    tail_nand, tail_halt, tail_map, tail_unmap, tail_out, tail_in,
+    tail_loadp, tail_lv, tail_invalid, tail_invalid
+};
+
+/* Name: tail_execute
+ * Input: a UM_T struct
+ * Output: N/A
+ * Does: Executes all instructions in segment zero until there is no
+ *       instruction left or until there is a halt instruction
+ *       Under TAIL_LOOP, calls the handler for each word in turn,
+ *       reloading segment zero after each in case it was replaced
+ * Error: Asserts if UM_T struct is NULL
+ */
+void tail_execute(UM_T um)
+{
+    UM_ASSERT(um != NULL);
+
+    uint32_t len;
+    const uint32_t *seg0 = seg_zero_words(um, &len);
+
+#ifdef TAIL_LOOP
+    uint32_t pc = 0;
+    while (pc < len &&
+           tail_table[seg0[pc] >> OP_LSB](um, um->regs, seg0, len, pc,
+                                          seg0[pc])) {
+        pc = tail_next;
+        seg0 = seg_zero_words(um, &len);
+    }
+#else
+    if (len == 0) {
+        return;
+    }
+
+    tail_table[seg0[0] >> OP_LSB](um, um->regs, seg0, len, 0, seg0[0]);
+#endif
+}
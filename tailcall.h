@@ -0,0 +1,14 @@
+/*
+ * Interface for the tail-call-threaded engine of the UM implementation
+ *
+ */
+
+#include "um.h"
+
+#ifndef TAILCALL_H_
+#define TAILCALL_H_
+
+/* Executes passed in program with one tail-calling function per opcode */
+void tail_execute(UM_T um);
+
+#endif
@@ -10,60 +10,102 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include "um.h"
-#include "uarray.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include "um.h"
 
 #define WORD_SIZE 32
 #define OP_WIDTH 4
 #define R_WIDTH 3
-#define RA_LSB 6
-#define RB_LSB 3
-#define RC_LSB 0
-#define NUM_REGISTERS 8
-#define REGISTER_LEN 8
-#define W_SIZE 32
-#define CHAR_SIZE 8
-#define CHAR_PER_WORD 4
-
-UM_T um_new(uint32_t length);
-void populate_seg_zero(UM_T um, FILE *fp, uint32_t size);
-uint32_t construct_word(FILE *fp);
-void um_execute(UM_T um);
-void um_free(UM_T *um);
-
-int main(int argc, char *argv[]) 
-{
-    if (argc != 2) {
-        fprintf(stderr, "Usage: ./um <Um file>\n");
-        return EXIT_FAILURE;
+#define LV_FIELDS_MASK 0xfffffff
+#define DEDUP_MIN_WORDS 64
+/* um_zero_alloc gives arrays this large pages of their own */
+#define ZERO_MAP_BYTES (128 * 1024)
+
+/* Dispatch indices for superinstructions, which follow the UM_UNDECODED
+ * entry and the 16 opcode entries. The pairs were picked from opcode
+ * bigram counts over midmark.um, sandmark.umz and codex.umz (up to its
+ * first IN): LV then SLOAD/SSTORE alone make up close to a third of the
+ * instructions executed, and LV->ADD, NAND->ADD, LV->LOADP and CMOV->LOADP
+ * each run in the tens of millions. NOT is NAND with rb == rc, which
+ * covers over half of all NANDs. LV LV ADD, by contrast, barely occurs.
+ */
+typedef enum Um_fused {
+    FUSE_NOT = (1 << OP_WIDTH) + 1, FUSE_LV_SLOAD, FUSE_LV_SSTORE,
+    FUSE_LV_ADD, FUSE_LV_LOADP, FUSE_CMOV_LOADP, FUSE_NAND_ADD,
+    FUSE_COUNT
+} Um_fused;
+#define REGISTER_LEN NUM_REGISTERS
+
+/* Set by --checked; only consulted by the trusted build (see UM_CHECK) */
+int um_checked = 0;
+int um_stats = 0;
+
+/* The UM whose output um_fault writes out before exiting */
+static UM_T um_running = NULL;
+
+/* Name: um_zero_alloc
+ * Input: a size in bytes
+ * Output: that many zeroed bytes
+ * Does: Allocates from malloc below ZERO_MAP_BYTES and otherwise maps
+ *       fresh pages, so that an array with an entry per word of a large
+ *       segment zero costs only the pages touched rather than clearing
+ *       all of it (calloc does that once glibc raises its mmap threshold)
+ * Error: Asserts if memory is not allocated
+ */
+void *um_zero_alloc(size_t bytes)
+{
+    void *ptr;
+
+    if (bytes < ZERO_MAP_BYTES) {
+        ptr = calloc(bytes, 1);
+        assert(ptr != NULL);
+    } else {
+        ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(ptr != MAP_FAILED);
     }
 
-    FILE *fp = fopen(argv[1], "r");
-    assert(fp != NULL);
-
-    struct stat file_info;
-    stat(argv[1], &file_info);
-    uint32_t size = file_info.st_size / CHAR_PER_WORD;
-
-    UM_T um = um_new(size);
-    assert(um != NULL);
-
-    populate_seg_zero(um, fp, size);
-
-    fclose(fp);
-    um_execute(um);
+    return ptr;
+}
 
-    um_free(&um);
+/* Name: um_zero_free
+ * Input: memory from um_zero_alloc (or NULL) and the size it was
+ *        allocated with
+ * Output: N/A
+ * Does: Frees it
+ */
+void um_zero_free(void *ptr, size_t bytes)
+{
+    if (bytes < ZERO_MAP_BYTES) {
+        free(ptr);
+    } else if (ptr != NULL) {
+        munmap(ptr, bytes);
+    }
+}
 
-    return EXIT_SUCCESS;
+/* Name: release_code
+ * Input: a UM_T struct
+ * Output: N/A
+ * Does: Frees the predecoded copy of segment zero, if any
+ */
+static void release_code(UM_T um)
+{
+    um_zero_free(um->code, ((size_t)um->code_len + 1) * sizeof(*um->code));
+    um->code = NULL;
+    um->code_len = 0;
 }
 
 /* Name: um_new
  * Input: a uint32_t representing the length of segment zero
  * Output: A newly allocated UM_T struct
  * Does: Allocates memory for a UM_T
- *       Creates a new Registers_T member and Memory_T member
+ *       Zeroes the registers and creates a new Memory_T member
+ *       Output starts out line buffered on a terminal and fully buffered
+ *       otherwise, as stdio would do
  * Error: Asserts if memory is not allocated
  */
 UM_T um_new(uint32_t length)
@@ -71,8 +113,20 @@ UM_T um_new(uint32_t length)
     UM_T um_new = malloc(sizeof(*um_new));
     assert(um_new != NULL);
 
-    um_new->reg = registers_new();
+    for (int index = 0; index < NUM_REGISTERS; ++index) {
+        um_new->regs[index] = 0;
+    }
     um_new->mem = memory_new(length);
+    um_new->code = NULL;
+    um_new->code_len = 0;
+    um_new->flush = isatty(STDOUT_FILENO) ? FLUSH_LINE : FLUSH_FULL;
+    um_new->out_len = 0;
+    um_new->in_next = NULL;
+    um_new->in_end = NULL;
+    um_new->in_map = NULL;
+    um_new->in_map_bytes = 0;
+    um_new->in_eof = 0;
+    um_running = um_new;
 
     return um_new;
 }
@@ -81,149 +135,470 @@ UM_T um_new(uint32_t length)
  * Input: A pointer to a UM_T struct 
  * Output: N/A 
  * Does: Frees all memory associated with the struct and its members
+ *       Writes out buffered output, and with --stats reports the memory
+ *       counters first
  * Error: Asserts if UM_T struct is NULL
  */
 void um_free(UM_T *um)
 {
     assert((*um) != NULL);
 
-    registers_free(&(*um)->reg);
+    um_flush(*um);
+    if (*um == um_running) {
+        um_running = NULL;
+    }
+    if (um_stats) {
+        memory_report((*um)->mem, stderr);
+    }
+
     memory_free(&(*um)->mem);
+    if ((*um)->in_map != NULL) {
+        munmap((*um)->in_map, (*um)->in_map_bytes);
+    }
+    release_code(*um);
     free(*um);
 }
 
-/* Name: um_execute
+/* Name: um_fault
+ * Input: a message saying what the program did wrong
+ * Output: N/A
+ * Does: Reports the fault on stderr and exits with failure; used for
+ *       failed UM_CHECKs and limits a program can run into on purpose,
+ *       where an assert would make the UM itself look broken
+ *       Output the program produced before the fault is written out first
+ */
+void um_fault(const char *message)
+{
+    if (um_running != NULL) {
+        um_flush(um_running);
+    }
+    fprintf(stderr, "um: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+/* Name: decode_word
+ * Input: a uint32_t word from segment zero
+ * Output: the word's fields as a Um_decoded
+ * Does: Unpacks the opcode and registers A, B, C, or for load value
+ *       the destination register and the 25-bit immediate
+ */
+static inline Um_decoded decode_word(uint32_t word)
+{
+    Um_decoded inst;
+
+    uint32_t opcode = word >> (WORD_SIZE - OP_WIDTH);
+
+    inst.handler = opcode + 1;
+    if (opcode == LV) {
+        inst.ra = (word >> LV_RA_LSB) & R_MASK;
+        inst.rb = 0;
+        inst.rc = 0;
+        inst.value = word & LV_VALUE_MASK;
+    } else {
+        inst.ra = (word >> RA_LSB) & R_MASK;
+        inst.rb = (word >> RB_LSB) & R_MASK;
+        inst.rc = (word >> RC_LSB) & R_MASK;
+        inst.value = 0;
+    }
+
+    return inst;
+}
+
+/* Name: decode_pair
+ * Input: the uint32_t word at some index of segment zero, and the word
+ *        after it (ignored if has_next is 0)
+ * Output: a Um_decoded for the word, fused with the next one when the two
+ *         form one of the Um_fused superinstructions
+ * Does: For LV pairs, ra, rb, rc are the second instruction's registers
+ *       and value holds the LV register and immediate (word bits 0-27)
+ *       For other pairs, ra, rb, rc belong to the first instruction and
+ *       value holds the second word
+ */
+static inline Um_decoded decode_pair(uint32_t word, uint32_t next,
+                                     int has_next)
+{
+    Um_decoded inst = decode_word(word);
+    uint32_t opcode = inst.handler - 1;
+
+    if (opcode == NAND && inst.rb == inst.rc) {
+        inst.handler = FUSE_NOT;
+    }
+    if (!has_next) {
+        return inst;
+    }
+
+    Um_decoded second = decode_word(next);
+    uint32_t next_op = second.handler - 1;
+
+    if (opcode == LV && (next_op == SLOAD || next_op == SSTORE ||
+                         next_op == ADD || next_op == LOADP)) {
+        inst = second;
+        inst.value = word & LV_FIELDS_MASK;
+        inst.handler = next_op == SLOAD  ? FUSE_LV_SLOAD
+                     : next_op == SSTORE ? FUSE_LV_SSTORE
+                     : next_op == ADD    ? FUSE_LV_ADD
+                     :                     FUSE_LV_LOADP;
+    } else if (opcode == CMOV && next_op == LOADP) {
+        inst.handler = FUSE_CMOV_LOADP;
+        inst.value = next;
+    } else if (opcode == NAND && next_op == ADD) {
+        inst.handler = FUSE_NAND_ADD;
+        inst.value = next;
+    }
+
+    return inst;
+}
+
+/* Name: um_flush
  * Input: a UM_T struct
  * Output: N/A
- * Does: Executes all instructions in segment zero until
- *       there is no instruction left or until there is a halt instruction
- *       Calls instruction_call to execute all instructions except
- *       load program and load value
- * Error: Asserts if UM_T struct is NULL
- *        Asserts if segment zero is NULL at any point
+ * Does: Writes the bytes OUT has buffered to standard output with as
+ *       few write calls as the kernel allows, and empties the buffer
+ * Notes: like stdio, output that cannot be written is dropped
  */
-void um_execute(UM_T um)
+void um_flush(UM_T um)
 {
-    assert(um != NULL);
+    uint32_t done = 0;
 
-    UArray_T seg_zero = (UArray_T)Seq_get(um->mem->segments, 0);
-    assert(seg_zero != NULL);
-
-    int seg_zero_len = UArray_length(seg_zero);
-    int prog_counter = 0;
-    uint32_t opcode, ra, rb, rc, word;
-
-    /* Execute words in segment zero until there are none left */
-    while (prog_counter < seg_zero_len) {
-        word = *(uint32_t *)UArray_at(seg_zero, prog_counter);
-        //opcode = Bitpack_getu(word, OP_WIDTH, WORD_SIZE - OP_WIDTH);
-        // op width = 4, second param = 28
-        /* get the opcode */
-        uint64_t opcode_shift = ((uint64_t)word << 32) >> 60;
-        opcode = opcode_shift;
-
-        prog_counter++;
-
-        uint64_t ra_shift = 0;
-        /* Load value */
-        if (opcode == 13) {
-            //uint32_t value_size = WORD_SIZE - OP_WIDTH - R_WIDTH;
-            //ra = Bitpack_getu(word, R_WIDTH, value_size);
-            ra_shift = ((uint64_t)word << 36) >> 61;
-            // printf("%" PRIu64 "\n", ra_shift);
-            ra = (uint32_t)ra_shift;
-            //printf("%" PRIu32 "\n", ra);
-
-            //uint32_t value = Bitpack_getu(word, value_size, 0);
-            uint64_t value_shift = ((uint64_t)word << 39) >> 39;
-            uint32_t value = value_shift;
-            load_value(um, ra, value);
+    while (done < um->out_len) {
+        ssize_t n = write(STDOUT_FILENO, um->out + done, um->out_len - done);
+        if (n < 0 && errno == EINTR) {
             continue;
-        } 
-
-        //ra = Bitpack_getu(word, R_WIDTH, RA_LSB);
-        ra_shift = ((uint64_t)word << 55) >> 61;
-        ra = ra_shift;
-        //rb = Bitpack_getu(word, R_WIDTH, RB_LSB);
-        uint64_t rb_shift = ((uint64_t)word << 58) >> 61;
-        rb = rb_shift;
-        //rc = Bitpack_getu(word, R_WIDTH, RC_LSB);
-        uint64_t rc_shift = ((uint64_t)word << 61) >> 61;
-        rc = rc_shift;
-
-        /* Load Program */
-        if (opcode == 12) {
-            /* Updates programs counter*/
-            prog_counter = load_program(um, ra, rb, rc);
-
-            seg_zero = (UArray_T)Seq_get(um->mem->segments, 0);
-            assert(seg_zero != NULL);
-
-            seg_zero_len = UArray_length(seg_zero);
-        } else {
-            instruction_call(um, opcode, ra, rb, rc);
         }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
     }
-}
 
-uint32_t arr_size(uint32_t arr[]) {
-        return sizeof(*arr) / sizeof(uint32_t);
+    um->out_len = 0;
 }
 
-void arr_resize(uint32_t *arr[])
+/* Name: map_input
+ * Input: a UM_T struct
+ * Output: 1 if standard input is a regular file with input left, now
+ *         mapped as the input buffer from the current offset, else 0
+ */
+static int map_input(UM_T um)
 {
-        arr = realloc(arr, (sizeof(*arr) * 2) + 1);
+    struct stat file_info;
+    if (fstat(STDIN_FILENO, &file_info) != 0 ||
+        !S_ISREG(file_info.st_mode)) {
+        return 0;
+    }
+
+    off_t pos = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (pos < 0 || pos >= file_info.st_size) {
+        return 0;
+    }
+
+    void *map = mmap(NULL, file_info.st_size, PROT_READ, MAP_PRIVATE,
+                     STDIN_FILENO, 0);
+    if (map == MAP_FAILED) {
+        return 0;
+    }
+    madvise(map, file_info.st_size, MADV_SEQUENTIAL);
+
+    um->in_map = map;
+    um->in_map_bytes = file_info.st_size;
+    um->in_next = (const uint8_t *)map + pos;
+    um->in_end = (const uint8_t *)map + file_info.st_size;
+
+    return 1;
 }
 
-void arr_addhi(uint32_t *arr[], uint32_t element)
+/* Name: um_fill_input
+ * Input: a UM_T struct whose input buffer is empty
+ * Output: 1 if there is more input, 0 at the end of input
+ * Does: The first time, maps standard input if it is a regular file;
+ *       the end of the mapping is then the end of input. Otherwise
+ *       reads up to IN_BUFFER_BYTES with one read call, writing out
+ *       buffered output first (unless the flush policy is FLUSH_NONE) in
+ *       case the read waits, so a prompt shows
+ * Notes: the end of input (or a read error, as with fgetc) is sticky
+ */
+int um_fill_input(UM_T um)
 {
-        //int arr_size = sizeof(arr) / sizeof(uint32_t);
-        uint32_t size = arr_size(*arr);
-        if (size == sizeof(*arr)) {
-            arr_resize(arr);
+    if (um->in_eof) {
+        return 0;
+    }
+
+    if (um->in_map == NULL && um->in_next == NULL && map_input(um)) {
+        return 1;
+    }
+
+    ssize_t n = 0;
+    if (um->in_map == NULL) {
+        if (um->out_len != 0 && um->flush != FLUSH_NONE) {
+            um_flush(um);
         }
+        do {
+            n = read(STDIN_FILENO, um->in, IN_BUFFER_BYTES);
+        } while (n < 0 && errno == EINTR);
+    }
+
+    if (n <= 0) {
+        um->in_eof = 1;
+        return 0;
+    }
+
+    um->in_next = um->in;
+    um->in_end = um->in + n;
 
-        *arr[size - 1] = element;
+    return 1;
 }
 
-void arr_addlo(uint32_t *arr[], uint32_t element)
+/* Name: grow_code
+ * Input: a UM_T struct
+ * Output: N/A
+ * Does: Extends um->code over words of a streaming segment zero that
+ *       arrived after it was allocated, all marked UM_UNDECODED, along
+ *       with the old last word so it can fuse with the first new one
+ * Error: Asserts if memory is not allocated
+ */
+static void grow_code(UM_T um)
 {
-        if (arr_size(*arr) == sizeof(*arr)) {
-            arr_resize(arr);
-        }
+    uint32_t len = um->mem->segments[0].len;
+    uint32_t old_len = um->code_len;
+    Um_decoded *code = um_zero_alloc(((size_t)len + 1) * sizeof(*code));
 
-        //uint32_t temp = *arr[0];
-        //*arr[0] = element;
-
-        //arr[1] = temp;
-        /*note, if resize doesn't work this can cause access problems */
-        uint32_t prev = *arr[0];
-        for (uint32_t i = 1; i < arr_size(*arr) + 1; i++) {
-            uint32_t temp = *arr[i];
-            *arr[i] = prev;
-            prev = temp;
-        }
+    memcpy(code, um->code, (size_t)old_len * sizeof(*code));
+    if (old_len > 0) {
+        code[old_len - 1].handler = UM_UNDECODED;
+    }
 
-        *arr[0] = element;
+    release_code(um);
+    um->code = code;
+    um->code_len = len;
 }
 
-void arr_remhi(uint32_t *arr[])
+/* Name: um_execute
+ * Input: a UM_T struct
+ * Output: N/A
+ * Does: Executes the program in segment zero from its first instruction
+ */
+void um_execute(UM_T um)
 {
-    arr[arr_size(*arr)] = 0;
+    um_execute_at(um, 0);
 }
 
-void arr_remlo(uint32_t *arr[])
+/* Name: um_execute_at
+ * Input: a UM_T struct and the index in segment zero to start at
+ * Output: N/A
+ * Does: Executes all instructions in segment zero from prog_counter until
+ *       there is no instruction left or until there is a halt instruction
+ *       Uses direct-threaded dispatch: every handler ends with its own
+ *       DISPATCH, which fetches the next predecoded instruction and jumps
+ *       straight to the label for its opcode
+ *       Words are decoded the first time they are reached, so entering a
+ *       new segment zero costs nothing up front
+ *       Superinstructions run the first instruction of a pair inline and
+ *       then jump to the second's handler with its registers loaded
+ *       Reaching the end of a segment zero that is still streaming in
+ *       waits for more of it
+ * Error: Asserts if UM_T struct is NULL
+ *        Asserts if segment zero is NULL at any point
+ *        Asserts if an opcode is invalid (14 or 15)
+ * Notes: relies on GCC labels-as-values; __extension__ keeps -pedantic quiet
+ */
+void um_execute_at(UM_T um, uint32_t prog_counter)
 {
-    for (size_t i = 0; i < arr_size(*arr) - 1; i++) {
-        arr[i] = arr[i + 1];
+    assert(um != NULL);
+
+    /* Handler labels indexed by Um_decoded.handler: opcode + 1, or a
+       Um_fused superinstruction */
+    static void *const dispatch_table[FUSE_COUNT] = {
+        __extension__ &&op_decode,
+        __extension__ &&op_cmov,   __extension__ &&op_sload,
+        __extension__ &&op_sstore, __extension__ &&op_add,
+        __extension__ &&op_mul,    __extension__ &&op_div,
+        __extension__ &&op_nand,   __extension__ &&op_halt,
+        __extension__ &&op_map,    __extension__ &&op_unmap,
+        __extension__ &&op_out,    __extension__ &&op_in,
+        __extension__ &&op_loadp,  __extension__ &&op_lv,
+        __extension__ &&op_invalid, __extension__ &&op_invalid,
+        __extension__ &&op_not,     __extension__ &&op_lv_sload,
+        __extension__ &&op_lv_sstore, __extension__ &&op_lv_add,
+        __extension__ &&op_lv_loadp, __extension__ &&op_cmov_loadp,
+        __extension__ &&op_nand_add
+    };
+
+    if (um->code == NULL) {
+        um_decode_seg_zero(um);
     }
-}
 
+    uint32_t ra, rb, rc;
+    Um_decoded inst;
+
+/* Fetches the predecoded instruction at prog_counter and jumps to its
+ * handler. Running off the end of segment zero goes to op_end. um->code is
+ * re-read every time because SSTORE may patch it in place. */
+#define DISPATCH()                                                        \
+    do {                                                                  \
+        if (prog_counter >= um->code_len) {                               \
+            goto op_end;                                                  \
+        }                                                                 \
+        inst = um->code[prog_counter++];                                  \
+        ra = inst.ra;                                                     \
+        rb = inst.rb;                                                     \
+        rc = inst.rc;                                                     \
+        __extension__ ({ goto *dispatch_table[inst.handler]; });          \
+    } while (0)
+
+    DISPATCH();
+
+op_end:
+    /* Execution ends here unless more of segment zero has arrived */
+    memory_await_zero(um->mem, prog_counter + 1);
+    if (um->code_len < um->mem->segments[0].len) {
+        grow_code(um);
+        DISPATCH();
+    }
+    return;
+op_decode:
+    /* First visit to this word: decode it in place and dispatch again */
+    prog_counter--;
+    if (prog_counter + 1 < um->code_len) {
+        um->code[prog_counter] =
+            decode_pair(memory_get(um->mem, 0, prog_counter),
+                        memory_get(um->mem, 0, prog_counter + 1), 1);
+    } else {
+        um->code[prog_counter] =
+            decode_pair(memory_get(um->mem, 0, prog_counter), 0, 0);
+    }
+    DISPATCH();
+op_cmov:
+    conditional_move(um, ra, rb, rc);
+    DISPATCH();
+op_sload:
+    segmented_load(um, ra, rb, rc);
+    DISPATCH();
+op_sstore:
+    segmented_store(um, ra, rb, rc);
+    DISPATCH();
+op_add:
+    add(um, ra, rb, rc);
+    DISPATCH();
+op_mul:
+    multiply(um, ra, rb, rc);
+    DISPATCH();
+op_div:
+    divide(um, ra, rb, rc);
+    DISPATCH();
+op_nand:
+    nand(um, ra, rb, rc);
+    DISPATCH();
+op_halt:
+    halt(um, ra, rb, rc);
+    return;
+op_map:
+    map_segment(um, ra, rb, rc);
+    DISPATCH();
+op_unmap:
+    unmap_segment(um, ra, rb, rc);
+    DISPATCH();
+op_out:
+    output(um, ra, rb, rc);
+    DISPATCH();
+op_in:
+    input(um, ra, rb, rc);
+    DISPATCH();
+op_loadp:
+    /* Updates program counter and decodes a replaced segment zero */
+    prog_counter = load_program(um, ra, rb, rc);
+
+    if (um->code == NULL) {
+        um_decode_seg_zero(um);
+    }
+    DISPATCH();
+op_lv:
+    load_value(um, ra, inst.value);
+    DISPATCH();
+op_invalid:
+    /* Faults even where UM_CHECK compiles to nothing */
+    UM_CHECK(0);
+    um_fault("invalid instruction");
+
+    /* Superinstructions: first half inline, then the second's handler */
+op_not:
+    um->regs[ra] = ~um->regs[rb];
+    DISPATCH();
+op_lv_sload:
+    load_value(um, inst.value >> LV_RA_LSB, inst.value & LV_VALUE_MASK);
+    prog_counter++;
+    goto op_sload;
+op_lv_sstore:
+    load_value(um, inst.value >> LV_RA_LSB, inst.value & LV_VALUE_MASK);
+    prog_counter++;
+    goto op_sstore;
+op_lv_add:
+    load_value(um, inst.value >> LV_RA_LSB, inst.value & LV_VALUE_MASK);
+    prog_counter++;
+    goto op_add;
+op_lv_loadp:
+    load_value(um, inst.value >> LV_RA_LSB, inst.value & LV_VALUE_MASK);
+    goto op_loadp;
+op_cmov_loadp:
+    conditional_move(um, ra, rb, rc);
+    ra = (inst.value >> RA_LSB) & R_MASK;
+    rb = (inst.value >> RB_LSB) & R_MASK;
+    rc = (inst.value >> RC_LSB) & R_MASK;
+    goto op_loadp;
+op_nand_add:
+    nand(um, ra, rb, rc);
+    ra = (inst.value >> RA_LSB) & R_MASK;
+    rb = (inst.value >> RB_LSB) & R_MASK;
+    rc = (inst.value >> RC_LSB) & R_MASK;
+    prog_counter++;
+    goto op_add;
+
+#undef DISPATCH
+}
 
+/* Name: um_decode_seg_zero
+ * Input: a UM_T struct
+ * Output: N/A
+ * Does: (Re)allocates um->code with one entry per word currently in
+ *       segment zero, all marked UM_UNDECODED; um_execute fills entries in
+ *       as it reaches them
+ * Error: Asserts if UM_T struct is NULL
+ *        Asserts if memory is not allocated
+ * Notes: The array comes from um_zero_alloc, so this costs time in the
+ *        words later decoded rather than in the length of segment zero
+ */
+void um_decode_seg_zero(UM_T um)
+{
+    assert(um != NULL);
 
+    uint32_t len = um->mem->segments[0].len;
 
+    release_code(um);
+    um->code = um_zero_alloc(((size_t)len + 1) * sizeof(*um->code));
+    um->code_len = len;
+}
 
+/* Name: um_patch_code
+ * Input: a UM_T struct, an offset into segment zero, and the word
+ *        just stored there
+ * Output: N/A
+ * Does: Marks a single instruction for re-decoding after a store into
+ *       segment zero, along with the one before it in case the two were
+ *       fused
+ *       Does nothing if the decoded copy has not been allocated yet
+ * Error: Asserts if UM_T struct is NULL
+ */
+void um_patch_code(UM_T um, uint32_t off, uint32_t word)
+{
+    assert(um != NULL);
+    (void)word;
 
+    if (um->code != NULL && off < um->code_len) {
+        um->code[off].handler = UM_UNDECODED;
+        if (off > 0) {
+            um->code[off - 1].handler = UM_UNDECODED;
+        }
+    }
+}
 
 /* Name: instruction_call
  * Input: UM_T struct of the um
@@ -234,14 +609,15 @@ void arr_remlo(uint32_t *arr[])
  * Error: Asserts if opcode is invalid
  *        Asserts if any register number is valid
  *        Asserts if UM_T sruct is NULL
- * Notes: is called by um_execute
+ * Notes: um_execute dispatches to the handlers directly; this entry point
+ *        is kept for the unit tests
  */
 void instruction_call(UM_T um, Um_opcode op, uint32_t ra, 
                       uint32_t rb, uint32_t rc)
 {
-    assert(op >= 0 && op < 14);
-    assert(ra < NUM_REGISTERS && rb < NUM_REGISTERS && rc < NUM_REGISTERS);
-    assert(um != NULL);
+    UM_CHECK(op < 14);
+    UM_ASSERT(ra < NUM_REGISTERS && rb < NUM_REGISTERS && rc < NUM_REGISTERS);
+    UM_ASSERT(um != NULL);
 
     switch (op) {
         case CMOV: conditional_move(um, ra, rb, rc);  break;
@@ -261,116 +637,353 @@ void instruction_call(UM_T um, Um_opcode op, uint32_t ra,
     }
 }
 
+/* Name: release_zero
+ * Input: A Memory_T struct whose segment 0 owns its storage
+ * Output: N/A
+ * Does: Frees segment 0's words, back to the slab or, for a native
+ *       image, by unmapping the file
+ */
+static void release_zero(Memory_T m)
+{
+        m->live_words -= m->segments[0].len;
+
+        if (m->zero_map != NULL) {
+                munmap(m->zero_map, m->zero_map_bytes);
+                m->zero_map = NULL;
+        } else {
+                slab_release(m->slab, m->segments[0].data,
+                             m->segments[0].len);
+        }
+}
+
 /* Name: load_program
  * Input: UM_T struct; uint32_t's reprsenting registers A, B, C
  * Output: a uint32_t representing the index that program should start at
- * Does: copies segment[rb value] into segment zero and returns rc value
+ * Does: makes segment zero share the storage of segment[rb value] and
+ *       returns rc value
+ *       The copy the UM semantics call for is deferred: memory_put and
+ *       memory_unmap call memory_unshare_zero the first time either side
+ *       is written or the source is unmapped, so loading a segment that
+ *       is never modified costs O(1)
+ *       A segment whose storage segment 0 already has (including one
+ *       deduplicated with it) keeps segment 0 and its decoded code as is
  * Error: Asserts UM_T struct is NULL
  *        Asserts if any register number is valid
  */
 uint32_t load_program(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < NUM_REGISTERS && rb < NUM_REGISTERS && rc < NUM_REGISTERS);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < NUM_REGISTERS && rb < NUM_REGISTERS && rc < NUM_REGISTERS);
 
-    uint32_t rb_val = registers_get(um->reg, rb);
+    uint32_t rb_val = um->regs[rb];
 
     /* If rb value is 0, 0 is already loaded into segment 0 */
     if (rb_val == 0) {
-        return registers_get(um->reg, rc);
+        return um->regs[rc];
     }
     
-    /* Get the segment to copy */
-    UArray_T to_copy = (UArray_T)Seq_get(um->mem->segments, rb_val);
-    assert(to_copy != NULL);
-
-    /* Creating a copy with the same specifications */
-    int seg_len = UArray_length(to_copy);
-    UArray_T copy = UArray_new(seg_len, UArray_size(to_copy));
-    assert(copy != NULL);
-
-    /* Deep copying */
-    for (int i = 0; i < seg_len; i++){
-        *(uint32_t *)UArray_at(copy, i) = 
-        *(uint32_t *)UArray_at(to_copy, i);
+    /* Get the segment to share */
+    Memory_T m = um->mem;
+    UM_CHECK(rb_val < m->seg_count && m->segments[rb_val].data != NULL);
+
+    /* A load still writing segment 0's storage has to finish first */
+    memory_await_zero(m, UINT32_MAX);
+
+    if (m->dedup) {
+        memory_dedup(m);
     }
 
-    /* Freeing segment 0 and inserting the copy */
-    UArray_T seg_zero = (UArray_T)Seq_get(um->mem->segments, 0);
-    UArray_free(&seg_zero);
-    Seq_put(um->mem->segments, 0, copy);
+    /* Same storage (already shared, or merged by dedup): nothing changes */
+    if (m->segments[rb_val].data == m->segments[0].data) {
+        return um->regs[rc];
+    }
 
-    return registers_get(um->reg, rc);
+    /* Freeing segment 0 unless its storage belongs to another segment */
+    if (m->zero_alias == 0) {
+        release_zero(m);
+    }
+    m->segments[0] = m->segments[rb_val];
+    m->segments[0].store_len = 0;
+    m->segments[rb_val].store_len = 0;
+    m->zero_alias = rb_val;
+    memory_reset_zero_watch(um->mem);
+
+    /* The decoded copy is stale; um_execute rebuilds it on demand */
+    release_code(um);
+
+    return um->regs[rc];
+}
+
+/* Name: charge_words
+ * Input: A Memory_T struct and a number of words about to be allocated
+ * Output: N/A
+ * Does: Counts the words as live, keeping track of the peak
+ * Error: Faults if they would take live words past the quota
+ * Notes: every allocation the program causes (MAP and copy-on-write
+ *        copies alike) comes through here, so the quota is a hard limit
+ */
+static void charge_words(Memory_T m, uint64_t words)
+{
+        if (m->max_words != 0 && m->live_words + words > m->max_words) {
+                um_fault("segment storage exceeds the --max-mem quota");
+        }
+        m->live_words += words;
+        if (m->live_words > m->peak_words) {
+                m->peak_words = m->live_words;
+        }
+}
+
+/* Name: copy_storage
+ * Input: A Memory_T struct and a mapped segment
+ * Output: N/A
+ * Does: Gives the segment a private copy of the storage it points to
+ * Error: Faults if the copy would take live words past the quota
+ */
+static void copy_storage(Memory_T m, Segment *seg)
+{
+        charge_words(m, seg->len);
+        uint32_t *copy = slab_alloc(m->slab, seg->len);
+
+        /* Deep copying */
+        memcpy(copy, seg->data, seg->len * sizeof(uint32_t));
+
+        seg->data = copy;
 }
 
+/* Name: shared_slot
+ * Input: A Memory_T struct and a pointer to segment storage
+ * Output: the hash table slot holding data, or the empty slot where it
+ *         would go
+ */
+static Shared_ref *shared_slot(Memory_T m, uint32_t *data)
+{
+        uint32_t mask = m->shared_cap - 1;
+        uint32_t i = (uint32_t)(((uintptr_t)data >> 3) *
+                                0x9e3779b97f4a7c15ull >> 32) & mask;
 
+        while (m->shared[i].data != NULL && m->shared[i].data != data) {
+                i = (i + 1) & mask;
+        }
 
-/* Name: memory_new
- * Input: a uint32_t representing the length of segment zero
- * Output: A newly allocated Memory_T struct
- * Does: * Creates a Sequence of UArray_T's, sets all segments to NULL besides
- *         segment 0, and segment 0 is initialized to be "length" long
-         * Creates a Sequence of uint32_t pointers and 
-           sets them to be the index of the unmapped segments
+        return &m->shared[i];
+}
+
+/* Name: shared_ref
+ * Input: A Memory_T struct and storage held by at least one segment
+ * Output: N/A
+ * Does: Counts one more segment sharing data, entering it in the hash
+ *       table (for its first holder and this one) if it is not there,
+ *       and doubling the table when it gets half full
  * Error: Asserts if memory is not allocated
  */
-/*Memory_T memory_new(uint32_t length)
+static void shared_ref(Memory_T m, uint32_t *data)
 {
-        Memory_T m_new = malloc(sizeof(*m_new));
-        assert(m_new != NULL);
+        if (2 * (m->shared_count + 1) > m->shared_cap) {
+                Shared_ref *old = m->shared;
+                uint32_t old_cap = m->shared_cap;
+
+                m->shared_cap = old_cap == 0 ? HINT * 2 : old_cap * 2;
+                m->shared_cap = 1u << (32 - __builtin_clz(m->shared_cap - 1));
+                m->shared = calloc(m->shared_cap, sizeof(Shared_ref));
+                assert(m->shared != NULL);
+
+                for (uint32_t i = 0; i < old_cap; i++) {
+                        if (old[i].data != NULL) {
+                                *shared_slot(m, old[i].data) = old[i];
+                        }
+                }
+                free(old);
+        }
 
-        // Creating the segments
-        m_new->segments = Seq_new(HINT);
-        assert(m_new->segments != NULL);
+        Shared_ref *ref = shared_slot(m, data);
+        if (ref->data == NULL) {
+                ref->data = data;
+                ref->refs = 1;
+                m->shared_count++;
+        }
+        ref->refs++;
+}
 
-        // Creating the sequence to keep track of free segments
-        m_new->free = Seq_new(HINT);
-        assert(m_new->free != NULL);
+/* Name: shared_drop
+ * Input: A Memory_T struct and storage a segment is letting go of
+ * Output: 1 if other segments still hold data, 0 if the caller was the
+ *         only one (so it may free or write it)
+ * Does: Counts one segment fewer sharing data; storage left with one
+ *       holder leaves the hash table
+ */
+static int shared_drop(Memory_T m, uint32_t *data)
+{
+        if (m->shared_count == 0) {
+                return 0;
+        }
 
-        // Sets all segments to NULL and populates free segment sequence
-        for (int seg_num = 0; seg_num < HINT; ++seg_num) {
-                Seq_addlo(m_new->segments, NULL);
+        Shared_ref *ref = shared_slot(m, data);
+        if (ref->data == NULL) {
+                return 0;
+        }
 
-                uint32_t *temp = malloc(sizeof(uint32_t));
-                assert(temp != NULL);
+        if (--ref->refs > 1) {
+                return 1;
+        }
 
-                *temp = seg_num;
-                Seq_addhi(m_new->free, temp);
+        /* Empty the slot, then re-enter the rest of its probe run */
+        uint32_t mask = m->shared_cap - 1;
+        uint32_t i = ref - m->shared;
+
+        ref->data = NULL;
+        m->shared_count--;
+        for (i = (i + 1) & mask; m->shared[i].data != NULL;
+             i = (i + 1) & mask) {
+                Shared_ref moved = m->shared[i];
+                m->shared[i].data = NULL;
+                *shared_slot(m, moved.data) = moved;
         }
 
-        // Creating segment zero with proper length
-        memory_map(m_new, length);
+        return 1;
+}
 
-        return m_new;
-}*/
+/* Name: memory_unshare_zero
+ * Input: A Memory_T struct
+ * Output: N/A
+ * Does: If segment 0 shares storage with another segment after a
+ *       load_program, deep copies that storage so segment 0 owns it again
+ * Error: Asserts if struct is NULL
+ *        Asserts if memory is not allocated
+ *        Faults if the copy would take live words past the quota
+ * Notes: the contents do not change, so decoded instructions stay valid
+ */
+void memory_unshare_zero(Memory_T m)
+{
+        assert(m != NULL);
+
+        if (m->zero_alias == 0) {
+                return;
+        }
+
+        copy_storage(m, &m->segments[0]);
+        m->zero_alias = 0;
+}
+
+/* Name: memory_adopt_zero
+ * Input: A Memory_T struct, a private file mapping and its size, and the
+ *        words inside it that become segment 0 and how many there are
+ * Output: N/A
+ * Does: Replaces segment 0 with words that stay in the mapping instead
+ *       of being copied to the slab; stores copy-on-write the pages they
+ *       touch, and the mapping goes away when segment 0 is next replaced
+ *       or the memory is freed
+ * Error: Asserts if segment 0 shares its storage
+ */
+void memory_adopt_zero(Memory_T m, void *map, size_t bytes,
+                       uint32_t *words, uint32_t length)
+{
+        assert(m->zero_alias == 0);
+
+        release_zero(m);
+        m->zero_map = map;
+        m->zero_map_bytes = bytes;
+
+        m->live_words += length;
+        if (m->live_words > m->peak_words) {
+                m->peak_words = m->live_words;
+        }
+        m->segments[0].data = words;
+        m->segments[0].len = length;
+        m->segments[0].store_len = 0;
+        memory_reset_zero_watch(m);
+}
+
+/* Name: memory_stream_zero
+ * Input: A Memory_T struct, a mapping and its size, and the stream that
+ *        fills the mapping with segment 0's words from its start
+ * Output: N/A
+ * Does: Makes the mapping segment 0, starting with no words; they are
+ *       counted in as memory_await_zero sees them arrive
+ * Error: Asserts if segment 0 shares its storage
+ */
+void memory_stream_zero(Memory_T m, void *map, size_t bytes,
+                        Zero_stream *stream)
+{
+        memory_adopt_zero(m, map, bytes, map, 0);
+        m->zero_stream = stream;
+}
+
+/* Name: memory_await_zero
+ * Input: A Memory_T struct and a number of words
+ * Output: N/A
+ * Does: If segment 0 is streaming in and has fewer than "words" words,
+ *       blocks until it has them or the stream ends, then extends
+ *       segment 0 over what has arrived.
+ *       A stream that comes up short has ended and is closed
+ */
+void memory_await_zero(Memory_T m, uint32_t words)
+{
+        Zero_stream *stream = m->zero_stream;
+
+        if (stream == NULL || m->segments[0].len >= words) {
+                return;
+        }
+
+        uint32_t arrived = stream->wait(stream, words);
 
-/* NEW MEMORY_NEW */
+        m->live_words += arrived - m->segments[0].len;
+        if (m->live_words > m->peak_words) {
+                m->peak_words = m->live_words;
+        }
+        m->segments[0].len = arrived;
+
+        if (arrived < words) {
+                m->zero_stream = NULL;
+                stream->close(stream);
+        }
+}
+
+/* Name: memory_new
+ * Input: a uint32_t representing the length of segment zero
+ * Output: A newly allocated Memory_T struct
+ * Does: * Creates a segment table with room for HINT segments and
+ *         maps segment 0 to be "length" long
+ *       * Creates an empty list of free segment IDs
+ * Error: Asserts if memory is not allocated
+ */
 Memory_T memory_new(uint32_t length) 
 {
-        //int m_new[] = (int*)calloc(length, sizeof(uint32_t));
         Memory_T m_new = malloc(sizeof(*m_new));
         assert(m_new != NULL);
-        //assert(m_new != null);
-        // don't assert
-        // init array of segments to bunch of 0
-        m_new->segments = (uint32_t*)calloc(HINT, sizeof(uint32_t)); // incorrect with CARRAY
+
+        m_new->segments = calloc(HINT, sizeof(Segment));
         assert(m_new->segments != NULL);
-        
-        // assert null?
+        m_new->seg_count = 0;
+        m_new->seg_cap = HINT;
 
-        m_new->free = (uint32_t*)calloc(HINT, sizeof(uint32_t));
+        m_new->free = malloc(HINT * sizeof(uint32_t));
         assert(m_new->free != NULL);
-
-        for (int seg_num = 0; seg_num < HINT; ++seg_num) {
-                m_new->segments[seg_num] = NULL;
-
-                uint32_t *temp = malloc(sizeof(uint32_t)); // change tio tiw
-                assert(temp != NULL);
-
-                *temp = seg_num;
-                m_new->free[seg_num] = temp;
-        }
+        m_new->free_count = 0;
+        m_new->free_cap = HINT;
+
+        m_new->slab = slab_new();
+        m_new->live_segments = 0;
+        m_new->live_words = 0;
+        m_new->peak_words = 0;
+        m_new->max_words = 0;
+        m_new->shared = NULL;
+        m_new->shared_cap = 0;
+        m_new->shared_count = 0;
+        m_new->dedup = 0;
+        m_new->seg_hash = calloc(HINT, sizeof(uint64_t));
+        assert(m_new->seg_hash != NULL);
+
+        m_new->zero_alias = 0;
+        m_new->zero_map = NULL;
+        m_new->zero_map_bytes = 0;
+        m_new->zero_stream = NULL;
+        m_new->zero_watch = NULL;
+        m_new->zero_watch_len = 0;
+        m_new->zero_dirty = NULL;
+        m_new->zero_dirty_count = 0;
+        m_new->zero_dirty_cap = 0;
         memory_map(m_new, length);
+        m_new->segments[0].store_len = 0;
 
         return m_new;
 }
@@ -378,174 +991,338 @@ Memory_T memory_new(uint32_t length)
 /* Name: memory_free
  * Input: A pointer to a Memory_T struct 
  * Output: N/A 
- * Does: Frees all memory associated with the struct
+ * Does: Frees all memory associated with the struct; segment storage
+ *       goes in one slab_free, however many segments are mapped
  * Error: Asserts if struct is NULL
  */
-/*void memory_free(Memory_T *m)
+void memory_free(Memory_T *m)
 {
         assert(*m != NULL);
 
-        // Freeing the UArray_T segments
-        int seg_len = Seq_length((*m)->segments);
-        for (int seg_num = 0; seg_num < seg_len; ++seg_num) {
-                UArray_T aux = (UArray_T)Seq_remhi((*m)->segments);
-                
-                // If the segment is unmapped, there is nothing to free
-                if (aux == NULL) {
-                        continue;
-                } else {
-                        UArray_free(&aux);
-                }
+        /* All segment storage goes with the allocator that owns it */
+        slab_free(&(*m)->slab);
+        if ((*m)->zero_stream != NULL) {
+                (*m)->zero_stream->close((*m)->zero_stream);
+        }
+        if ((*m)->zero_map != NULL) {
+                munmap((*m)->zero_map, (*m)->zero_map_bytes);
         }
+        free((*m)->segments);
+        free((*m)->shared);
+        free((*m)->seg_hash);
+        free((*m)->free);
+        um_zero_free((*m)->zero_watch, (*m)->zero_watch_len);
+        free((*m)->zero_dirty);
+        free(*m);
+}
+
+/* Name: memory_set_quota
+ * Input: A Memory_T struct and a number of words
+ * Output: N/A
+ * Does: Makes any MAP or copy-on-write copy that would leave more than
+ *       max_words words of segment storage live a UM fault; 0 removes
+ *       the limit
+ */
+void memory_set_quota(Memory_T m, uint64_t max_words)
+{
+        m->max_words = max_words;
+}
+
+/* Name: memory_report
+ * Input: A Memory_T struct and a stream
+ * Output: N/A
+ * Does: Prints the live segment count, how many copies of storage
+ *       deduplication has shared, live and peak words, and the bytes of
+ *       freed storage given back to the kernel
+ */
+void memory_report(Memory_T m, FILE *out)
+{
+        fprintf(out, "segments: %u live, %u shared copies\n"
+                     "words: %llu live, %llu peak\n"
+                     "returned: %llu bytes\n",
+                m->live_segments, m->shared_count,
+                (unsigned long long)m->live_words,
+                (unsigned long long)m->peak_words,
+                (unsigned long long)slab_returned(m->slab));
+}
+
+/* Name: content_hash
+ * Input: a segment's words and length
+ * Output: a 64-bit hash of the contents, never 0 (which seg_hash uses for
+ *         no hash)
+ */
+static uint64_t content_hash(const uint32_t *data, uint32_t len)
+{
+        uint64_t h = 0xcbf29ce484222325ull ^ len;
 
-        // Freeing the uint32_t pointers
-        int free_len = Seq_length((*m)->free);
-        for (int seg_num = 0; seg_num < free_len; ++seg_num) {
-            uint32_t *integer = (uint32_t *)Seq_remhi((*m)->free);
-            free(integer);
+        for (uint32_t i = 0; i < len; i++) {
+                h = (h ^ data[i]) * 0x100000001b3ull;
         }
 
-        // Freeing everything else
-        Seq_free(&(*m)->segments);
-        Seq_free(&(*m)->free);
-        free(*m);
-}*/
+        return h != 0 ? h : 1;
+}
 
-void memory_free(Memory_T *m)
+/* Name: memory_dedup
+ * Input: A Memory_T struct
+ * Output: N/A
+ * Does: One deduplication pass and checkpoint. Every segment of at least
+ *       DEDUP_MIN_WORDS words that has not been stored to since the
+ *       previous pass is hashed, unless a pass already did and the hash
+ *       is still in seg_hash; segments with equal contents are made to
+ *       share one copy-on-write copy of the storage and the others are
+ *       freed. Segments that were written get store_len 0, so memory_put
+ *       sees whether they are written again before the next pass.
+ *       Segment 0 and the segment sharing its storage are left alone.
+ * Error: Asserts if memory is not allocated
+ */
+void memory_dedup(Memory_T m)
 {
-        int seg_len = arr_size((*m)->segments);
-        for (int seg_num = 0; seg_num < seg_len; ++seg_num) {
-                UArray_T aux = (UArray_T)arr_remhi((*m)->segments);
-                
-                /* If the segment is unmapped, there is nothing to free */
-                if (aux == NULL) {
+        uint32_t cap = 1u << (32 - __builtin_clz(2 * m->seg_count + 1));
+        struct { uint64_t hash; uint32_t seg; } *seen;
+
+        seen = calloc(cap, sizeof(*seen));
+        assert(seen != NULL);
+
+        for (uint32_t seg_num = 1; seg_num < m->seg_count; seg_num++) {
+                Segment *seg = &m->segments[seg_num];
+                if (seg->data == NULL || seg_num == m->zero_alias ||
+                    seg->len < DEDUP_MIN_WORDS) {
+                        continue;
+                }
+
+                /* Written since the last pass: watch it until the next */
+                if (seg->store_len != 0) {
+                        seg->store_len = 0;
                         continue;
-                } else {
-                        free(&aux);
+                }
+
+                if (m->seg_hash[seg_num] == 0) {
+                        m->seg_hash[seg_num] = content_hash(seg->data,
+                                                            seg->len);
+                }
+                uint64_t h = m->seg_hash[seg_num];
+                uint32_t i = (uint32_t)h & (cap - 1);
+
+                for (; seen[i].seg != 0; i = (i + 1) & (cap - 1)) {
+                        Segment *same = &m->segments[seen[i].seg];
+                        if (seen[i].hash == h && same->len == seg->len &&
+                            (same->data == seg->data ||
+                             memcmp(same->data, seg->data,
+                                    seg->len * sizeof(uint32_t)) == 0)) {
+                                break;
+                        }
+                }
+
+                if (seen[i].seg == 0) {
+                        seen[i].hash = h;
+                        seen[i].seg = seg_num;
+                        continue;
+                }
+
+                /* Merge into the first segment seen with these contents */
+                uint32_t *keep = m->segments[seen[i].seg].data;
+                if (seg->data != keep) {
+                        if (!shared_drop(m, seg->data)) {
+                                m->live_words -= seg->len;
+                                slab_release(m->slab, seg->data, seg->len);
+                        }
+                        shared_ref(m, keep);
+                        seg->data = keep;
                 }
         }
 
-        free(&(*m)->segments);
-        free(&(*m)->free);
-        free(*m);
+        free(seen);
+}
+
+/* Name: memory_set_dedup
+ * Input: A Memory_T struct and a flag
+ * Output: N/A
+ * Does: Sets whether every load_program from another segment runs a
+ *       memory_dedup pass first
+ */
+void memory_set_dedup(Memory_T m, int on)
+{
+        m->dedup = on;
+}
+
+/* Name: memory_reset_zero_watch
+ * Input: A Memory_T struct
+ * Output: N/A
+ * Does: Stops watching segment 0 and forgets words written since;
+ *       called whenever segment 0 is replaced
+ */
+void memory_reset_zero_watch(Memory_T m)
+{
+        um_zero_free(m->zero_watch, m->zero_watch_len);
+        m->zero_watch = NULL;
+        m->zero_watch_len = 0;
+        m->zero_dirty_count = 0;
+}
+
+/* Name: memory_watch_zero
+ * Input: A Memory_T struct and an offset into segment 0
+ * Output: N/A
+ * Does: Asks memory_put to report writes to the word at off; the watch
+ *       map is allocated on first use, and regrown for words of a
+ *       streaming segment 0 that arrived since
+ * Error: Asserts if memory is not allocated
+ */
+void memory_watch_zero(Memory_T m, uint32_t off)
+{
+        if (off >= m->zero_watch_len) {
+                uint32_t len = m->segments[0].len + 1;
+                uint8_t *watch = um_zero_alloc(len);
+
+                if (m->zero_watch != NULL) {
+                        memcpy(watch, m->zero_watch, m->zero_watch_len);
+                }
+                um_zero_free(m->zero_watch, m->zero_watch_len);
+                m->zero_watch = watch;
+                m->zero_watch_len = len;
+        }
+
+        m->zero_watch[off] = 1;
+}
+
+/* Name: memory_take_zero_dirty
+ * Input: A Memory_T struct and a pointer to receive an offset
+ * Output: 1 if a watched word of segment 0 has been written (its offset
+ *         is stored in *off), otherwise 0
+ * Does: The word is no longer watched, so the caller must watch it again
+ *       once it has re-cached anything from it
+ */
+int memory_take_zero_dirty(Memory_T m, uint32_t *off)
+{
+        if (m->zero_dirty_count == 0) {
+                return 0;
+        }
+
+        *off = m->zero_dirty[--m->zero_dirty_count];
+        return 1;
 }
 
 /* Name: memory_put
  * Input: A Memory_T struct, a segment number, an offset, and a value
  * Output: N/A
  * Does: Inserts value at the specificed segment and offset
- * Error: Asserts if struct is NULL
- *        Asserts if segment is not mapped
+ *       Writes to a watched page of segment 0 mark that page dirty
+ *       The first write to deduplicated storage makes a private copy
+ *       Waits for words of a streaming segment 0 that have not arrived
+ * Error: Asserts if segment is not mapped
  *        Asserts if offset is not mapped
  */
-/*void memory_put(Memory_T m, uint32_t seg, uint32_t off, uint32_t val)
+void memory_put(Memory_T m, uint32_t seg, uint32_t off, uint32_t val)
 {
-        assert(m != NULL);
-        assert(seg < (uint32_t)Seq_length(m->segments));
+        /* Writing either side of a shared segment 0 breaks the sharing */
+        if (m->zero_alias != 0 && (seg == 0 || seg == m->zero_alias)) {
+                memory_unshare_zero(m);
+        }
 
-        UArray_T queried_segment = (UArray_T)Seq_get(m->segments, seg);
-        assert(queried_segment != NULL);
-        assert(off < (uint32_t)UArray_length(queried_segment));
+        /* The stream must not overwrite the store later */
+        if (seg == 0 && off >= m->segments[0].len) {
+                memory_await_zero(m, off + 1);
+        }
 
-        *(uint32_t *)UArray_at(queried_segment, off) = val;
-}*/
+        UM_CHECK(seg < m->seg_count);
+        Segment *queried_segment = &m->segments[seg];
+        UM_CHECK(queried_segment->data != NULL);
+        UM_CHECK(off < queried_segment->len);
 
-void memory_put(Memory_T m, uint32_t seg, uint32_t off, uint32_t val)
-{
-        uint32_t queried_segment[] = m->segments[seg];
-        assert(queried_segment != NULL);
-        assert(off < (uint32_t)arr_size(queried_segment));
+        /* First store since deduplication shared or watched it, which
+           also makes its hash stale */
+        if (queried_segment->store_len == 0 && seg != 0) {
+                if (shared_drop(m, queried_segment->data)) {
+                        copy_storage(m, queried_segment);
+                }
+                queried_segment->store_len = queried_segment->len;
+                m->seg_hash[seg] = 0;
+        }
 
-        queried_segment[off] = val;
+        queried_segment->data[off] = val;
+
+        /* Write barrier: only words something has cached code from */
+        if (seg == 0 && off < m->zero_watch_len && m->zero_watch[off]) {
+                m->zero_watch[off] = 0;
+                if (m->zero_dirty_count == m->zero_dirty_cap) {
+                        m->zero_dirty_cap = m->zero_dirty_cap == 0 ?
+                                HINT : m->zero_dirty_cap * 2;
+                        m->zero_dirty = realloc(m->zero_dirty,
+                                                m->zero_dirty_cap *
+                                                sizeof(uint32_t));
+                        assert(m->zero_dirty != NULL);
+                }
+                m->zero_dirty[m->zero_dirty_count++] = off;
+        }
 }
+
 /* Name: memory_get
  * Input: A Memory_T struct, a segment number, and an offset
  * Output: A uint32_t which represents the value at that segment and offset
  * Does: Gets the value at the specified segment number and offset and returns
- * Error: Asserts if struct is NULL
- *        Asserts if segment is not mapped
+ *       Waits for words of a streaming segment 0 that have not arrived
+ * Error: Asserts if segment is not mapped
  *        Asserts if offset is not mapped
  */
-/*uint32_t memory_get(Memory_T m, uint32_t seg, uint32_t off)
-{
-        assert(m != NULL);
-        assert(seg < (uint32_t)Seq_length(m->segments));
-        
-        UArray_T queried_segment = (UArray_T)Seq_get(m->segments, seg);
-        assert(queried_segment != NULL);
-        assert(off < (uint32_t)UArray_length(queried_segment));
-
-        return *(uint32_t *)UArray_at(queried_segment, off);
-}*/
 uint32_t memory_get(Memory_T m, uint32_t seg, uint32_t off)
 {
-        uint32_t queried_segment[] = m->segments[seg];
-        assert(queried_segment != NULL);
-        assert(off < (uint32_t)arr_size(queried_segment));
+        if (seg == 0 && off >= m->segments[0].len) {
+                memory_await_zero(m, off + 1);
+        }
+
+        UM_CHECK(seg < m->seg_count);
+        Segment *queried_segment = &m->segments[seg];
+        UM_CHECK(queried_segment->data != NULL);
+        UM_CHECK(off < queried_segment->len);
 
-        return queried_segment[off];
+        return queried_segment->data[off];
 }
 
 /* Name: memory_map
- * Input: A Memory_T struct, a segment number, and segment length
+ * Input: A Memory_T struct and segment length
  * Output: the index of the mapped segment
  * Does: Creates a segment that is "length" long 
  *       with all of the segment's values being zero and 
  *       returns index of the mapped segment
+ *       Reuses the most recently unmapped ID if there is one (its slot
+ *       is likely still in cache), otherwise takes a
+ *       new ID at the end of the table, doubling the table when full
+ *       Counts the segment and its words, keeping track of the peak
  * Error: Asserts if struct is NULL
  *        Asserts if memory for segment is not allocated
+ *        Faults if the segment would take live words past the quota
  */
-/*uint32_t memory_map(Memory_T m, uint32_t length)
+uint32_t memory_map(Memory_T m, uint32_t length)
 {
-        assert(m != NULL);
-
-        UArray_T seg = UArray_new(length, sizeof(uint32_t));
-        assert(seg != NULL);
-
-        // Setting values in new segment to 0 
-        for (uint32_t arr_index = 0; arr_index < length; ++arr_index) {
-                *(uint32_t *)UArray_at(seg, arr_index) = 0;
-        }
-
-        // Mapping a segment
-        uint32_t index = Seq_length(m->segments);
-        if (Seq_length(m->free) == 0) {
-            // If there are no free segments, 
-            //   put UArray_T at end of sequence 
-            Seq_addhi(m->segments, seg);
+        UM_ASSERT(m != NULL);
+
+        charge_words(m, length);
+        m->live_segments++;
+
+        /* Even a zero-length segment gets a block, so data is non-NULL */
+        uint32_t *seg = slab_alloc(m->slab, length);
+
+        uint32_t index;
+        if (m->free_count == 0) {
+                /* If there are no free segments, grow the table */
+                if (m->seg_count == m->seg_cap) {
+                        m->seg_cap *= 2;
+                        m->segments = realloc(m->segments,
+                                              m->seg_cap * sizeof(Segment));
+                        assert(m->segments != NULL);
+                        m->seg_hash = realloc(m->seg_hash,
+                                              m->seg_cap * sizeof(uint64_t));
+                        assert(m->seg_hash != NULL);
+                }
+                index = m->seg_count++;
         } else {
-            // If there is a free segment, 
-            //   get the index and put the UArray_T at that index
-            uint32_t *free_seg_num = (uint32_t *)Seq_remlo(m->free);
-            index = *free_seg_num;
-            free(free_seg_num);
-            Seq_put(m->segments, index, seg);
+                /* If there is a free segment, pop the most recent one */
+                index = m->free[--m->free_count];
         }
 
-        return index;
-}*/
-
-uint32_t memory_map(Memory_T m, uint32_t length) {
-
-        uint32_t seg[] = calloc(length, sizeof(uint32_t));
-        assert(seg != NULL);
-
-        int seg_size = arr_size(seg);
-        //int free_size = sizeof(free) / sizeof(uint32_t);
-        uint32_t index = seg_size;
-        if (seg_size == 0) {
-            segments[sizeof(m->segments) / sizeof(uint32_t)] = seg;
-        } else {
-            uint32_t *free_seg_num = (uint32_t *)arr_remlo(m->free);
-            index = *free_seg_num;
-            free(&free_seg_num);
-
-            // map the new segment and resize if needed
-            if (arr_size(m->segments) == sizeof(m->segments)) {
-                arr_resize(m->segments);
-            }
-            m->segments[index] = seg;
-        }
+        m->segments[index].data = seg;
+        m->segments[index].len = length;
+        m->segments[index].store_len = length;
+        m->seg_hash[index] = 0;
 
         return index;
 }
@@ -554,58 +1331,53 @@ uint32_t memory_map(Memory_T m, uint32_t length) {
  * Input: A Memory_T struct and a segment number
  * Output: N/A
  * Does: Unmaps a specified segment at the "seg_num" index and frees memory
- *       of the associated segment as well as adds that index back into the
- *       free segment sequence
- * Error: Asserts if struct is NULL
- *        Asserts if unmap segment 0
- *        Asserts if segment is NULL
+ *       of the associated segment as well as pushes that index onto the
+ *       free segment stack
+ * Error: Asserts if unmap segment 0
+ *        Asserts if segment is not mapped
+ *        Asserts if memory is not allocated
  */
-/*void memory_unmap(Memory_T m, uint32_t seg_num)
-{
-        assert(m != NULL);
-        assert(seg_num != 0);
-
-        UArray_T unmap = Seq_get(m->segments, seg_num);
-        assert(unmap != NULL);
-
-        UArray_free(&unmap);
-
-        uint32_t *free_seg = malloc(sizeof(uint32_t));
-        assert(free_seg != NULL);
-
-        *free_seg = seg_num;
-        Seq_addhi(m->free, free_seg);
-
-        Seq_put(m->segments, seg_num, NULL);
-}*/
 void memory_unmap(Memory_T m, uint32_t seg_num)
 {
-        uint32_t unmap[] = m->segments[seg_num];
-        assert(unmap != NULL);
-
-        free(&unmap);
-
-        uint32_t *free_seg = malloc(sizeof(uint32_t));
-        assert(free_seg != NULL);
-
-        *free_seg = seg_num;
-        arr_addhi(&m->free, *free_seg);
-
-        m->segments[seg_num] = 0;
+        UM_CHECK(seg_num != 0 && seg_num < m->seg_count);
+        Segment *unmap = &m->segments[seg_num];
+        UM_CHECK(unmap->data != NULL);
+
+        /* Segment 0 inherits storage it shares with the unmapped segment,
+           unless deduplication shares it further */
+        if (seg_num == m->zero_alias) {
+                m->zero_alias = 0;
+                if (shared_drop(m, unmap->data)) {
+                        copy_storage(m, &m->segments[0]);
+                }
+        } else if (!shared_drop(m, unmap->data)) {
+                m->live_words -= unmap->len;
+                slab_release(m->slab, unmap->data, unmap->len);
+        }
+        m->live_segments--;
+        unmap->data = NULL;
+        unmap->len = 0;
+        unmap->store_len = 0;
+
+        if (m->free_count == m->free_cap) {
+                m->free_cap *= 2;
+                m->free = realloc(m->free, m->free_cap * sizeof(uint32_t));
+                assert(m->free != NULL);
+        }
+        m->free[m->free_count++] = seg_num;
 }
 
 /* registers */
 /* Struct definition of a Register_T which 
-   contains an unboxed array of uint32_t's to store vals in registers */
+   contains a plain array of uint32_t's to store vals in registers */
 struct Registers_T {
-        UArray_T registers;
+        uint32_t registers[REGISTER_LEN];
 }; 
 
 /* Name: registers_new
  * Input: N/A
  * Output: A registers_T struct with values set to zero
- * Does: Initializes a Registers_T struct with a UArray_T with 8 indices and
- *       values set to zero
+ * Does: Initializes a Registers_T struct with 8 registers set to zero
  * Error: Asserts if memory is not allocated
  */
 Registers_T registers_new()
@@ -613,12 +1385,9 @@ Registers_T registers_new()
         Registers_T r_new = malloc(sizeof(*r_new));
         assert(r_new != NULL);
 
-        r_new->registers = UArray_new(REGISTER_LEN, sizeof(uint32_t));
-        assert(r_new->registers != NULL);
-
         /* Sets register's values to 0 */
         for (int index = 0; index < REGISTER_LEN; ++index) {
-                *(uint32_t *)UArray_at(r_new->registers, index) = 0;
+                r_new->registers[index] = 0;
         }
 
         return r_new;
@@ -634,15 +1403,13 @@ void registers_free(Registers_T *r)
 {
         assert(*r != NULL);
 
-        UArray_free(&(*r)->registers);
         free(*r);
 }
 
 /* Name: registers_put
  * Input: A registers_t struct, a register index, and a value
  * Output: N/A
- * Does: Inserts the value into the UArray in the Registers_T struct at index
- *       num_register
+ * Does: Inserts the value into the Registers_T struct at index num_register
  * Error: Asserts if invalid register
           Asserts if struct is NULL
  */
@@ -651,14 +1418,13 @@ void registers_put(Registers_T r, uint32_t num_register, uint32_t value)
         assert(r != NULL);
         assert(num_register < REGISTER_LEN);
 
-        *(uint32_t *)UArray_at(r->registers, num_register) = value;
+        r->registers[num_register] = value;
 }
 
 /* Name: registers_get
  * Input: a registers_t struct and a register index
  * Output: a uint32_t representing the value in the register
- * Does: Gets the value at the index num_register in the UArray in the struct
- *       and returns
+ * Does: Gets the value at the index num_register in the struct and returns
  * Error: Asserts if invalid register
  *        Asserts if struct is NULL
  */
@@ -667,60 +1433,6 @@ uint32_t registers_get(Registers_T r, uint32_t num_register)
         assert(r != NULL);
         assert(num_register < REGISTER_LEN);
 
-        return *(uint32_t *)UArray_at(r->registers, num_register);
+        return r->registers[num_register];
 }
 
-/* um_driver.c */
-
-/* Name: populate_seg_zero
- * Input: A UM_t struct, a file pointer, and a size
- * Output: N/A
- * Does: Populates segment zero with words from the file
- * Error: Asserts if UM_T struct is NULL
- *        Asserts if fp does not exist
- */
-void populate_seg_zero(UM_T um, FILE *fp, uint32_t size)
-{
-    assert(um != NULL);
-    assert(fp != NULL);
-
-    for (uint32_t index = 0; index < size; ++index) {
-        uint32_t word = construct_word(fp);
-
-        populate(um, index, word);
-    }
-}
-
-/* Name: construct_word
- * Input: a file pointer
- * Output: a uint32_t representing a word
- * Does: grabs 8 bits in big endian order and 
- *       creates a 32 bit word which is returned
- * Error: Asserts if file pointer is NULL
- */
-uint32_t construct_word(FILE *fp)
-{
-    assert(fp != NULL);
-
-    uint32_t c = 0, word = 0;
-    int bytes = W_SIZE / CHAR_SIZE;
-
-    /* Reads in a char and creates word in big endian order */
-    for (int c_loop = 0; c_loop < bytes; c_loop++) {
-        c = getc(fp);
-        assert(!feof(fp));
-
-        unsigned lsb = W_SIZE - (CHAR_SIZE * c_loop) - CHAR_SIZE;
-        //word_shift = ((uint64_t)word << )
-        //ra_shift = ((uint64_t)word << 55) >> 61;
-        //ra = ra_shift;
-        //word = Bitpack_newu(word, CHAR_SIZE, lsb, c);
-        //word 
-        unsigned hi = 8 + lsb;
-        word = (((uint64_t)word >> hi) << hi)
-                | (((uint64_t)word << (64 - lsb)) >> (64 - lsb))
-                | ((int64_t)c << lsb);
-    }
-
-    return word;
-}
\ No newline at end of file
@@ -4,12 +4,40 @@
  */
 
 #include <stdint.h>
-#include "seq.h"
+#include <stdio.h>
+#include "slab.h"
 
 #ifndef UM_H_
 #define UM_H_
 
 #define HINT 10
+#define NUM_REGISTERS 8
+#define OUT_BUFFER_BYTES (1u << 16)
+#define IN_BUFFER_BYTES (1u << 16)
+
+/* UM_ASSERT guards things that cannot go wrong for any program, such as a
+   NULL UM_T or a register number decoded from a 3-bit field. The trusted
+   build (um-fast, compiled with -DUM_TRUSTED) drops these entirely.
+   UM_CHECK guards failures the UM spec allows a program to cause
+   (unmapped segment, offset out of bounds, divide by zero, output over
+   255). um-fast only performs them when run with --checked. A failed
+   check goes through um_fault, so buffered output is written out first. */
+extern int um_checked;
+#ifdef UM_TRUSTED
+#define UM_ASSERT(e) ((void)sizeof(e))
+#define UM_CHECK(e) \
+    do { if (um_checked && !(e)) { um_fault("failed check: " #e); } } while (0)
+#else
+#define UM_ASSERT(e) assert(e)
+#define UM_CHECK(e) \
+    do { if (!(e)) { um_fault("failed check: " #e); } } while (0)
+#endif
+
+/* Stops the UM over a failure the running program caused */
+void um_fault(const char *message) __attribute__((noreturn));
+
+/* Set by --stats: um_free reports the memory counters on stderr */
+extern int um_stats;
 
 /* Pointer to a struct that contains the data structure for this module */
 typedef struct UM_T *UM_T;
@@ -20,33 +48,156 @@ typedef enum Um_opcode {
     NAND, HALT, MAP, UNMAP, OUT, IN, LOADP, LV
 } Um_opcode;
 
+/* Fields of an instruction word: the opcode is the top four bits; LV has
+   a register and a 25-bit value below it, the rest three registers */
+#define OP_LSB 28
+#define R_MASK 0x7
+#define RA_LSB 6
+#define RB_LSB 3
+#define RC_LSB 0
+#define LV_RA_LSB 25
+#define LV_VALUE_MASK 0x1ffffff
+
+/* When buffered OUT bytes are written out, besides when the buffer fills
+   up and when the UM halts or faults: FLUSH_FULL also before IN waits
+   for input, FLUSH_LINE then and after every newline, FLUSH_NONE never */
+typedef enum Um_flush {
+    FLUSH_FULL = 0, FLUSH_LINE, FLUSH_NONE
+} Um_flush;
+
+/* A segment zero word with its fields already unpacked.
+   handler is the um_execute dispatch index: UM_UNDECODED for a word that
+   has not been decoded yet (so a zeroed array needs no initialization),
+   otherwise the opcode + 1.
+   For LV, ra holds the destination register and value the immediate */
+typedef struct Um_decoded {
+    uint8_t handler, ra, rb, rc;
+    uint32_t value;
+} Um_decoded;
+
+#define UM_UNDECODED 0
+
 /* Pointer to a struct that contains the data structure for this module */
 typedef struct Registers_T *Registers_T;
 
 /* Pointer to a struct that contains the data structure for this module */
 typedef struct Memory_T *Memory_T;
 
+/* A segment in the segment table: its words and how many there are.
+   data is NULL for a segment ID that is not mapped. store_len is len
+   when SSTORE may write the words directly, and 0 when stores have to go
+   through memory_put: segment 0 and the segment sharing its storage,
+   segments sharing deduplicated storage, and segments being watched for
+   writes since the last deduplication pass */
+typedef struct Segment {
+        uint32_t *data;
+        uint32_t len;
+        uint32_t store_len;
+} Segment;
+
+/* Storage that deduplication made several segments share, and how many
+   of them do; an entry in the Memory_T hash table keyed by data */
+typedef struct Shared_ref {
+        uint32_t *data;
+        uint32_t refs;
+} Shared_ref;
+
+/* Segment 0 words still arriving from a streaming load (see loader.c).
+   wait blocks until at least "words" words have arrived or the load is
+   over, and returns how many have; close stops the load if it is still
+   going and frees the stream */
+typedef struct Zero_stream Zero_stream;
+struct Zero_stream {
+        uint32_t (*wait)(Zero_stream *stream, uint32_t words);
+        void (*close)(Zero_stream *stream);
+};
+
 /* Struct definition of a Memory_T which 
-   contains two sequences: 
-   - one holding pointers to UArray_T's representing segments
-   - one holding pointers to uint32_t's representing free segments */
+   contains two growable arrays: 
+   - the segment table, indexed by segment ID, with seg_count IDs handed
+     out so far (doubled when it fills up)
+   - a stack of the IDs of unmapped segments waiting to be reused,
+     popped most recently unmapped first
+   and the allocator that segment storage comes from
+   and zero_alias, the segment whose storage segment 0 currently shares
+   after a load_program (0 when segment 0 owns its storage)
+   and the segment 0 write barrier: one byte per word of segment 0 saying
+   whether some cache holds code from it (zero_watch, zero_watch_len words
+   long and NULL until something is watched) and a stack of the watched
+   words written since (zero_dirty)
+   and the memory accounting: mapped segment IDs, words of storage they
+   hold (shared storage counted once), the most words ever held, and the
+   quota neither MAP nor a copy-on-write copy may take live_words past (0
+   for none); the quota counts words after copy-on-write copies are made,
+   so segment 0 loaded from a segment and then stored to counts twice
+   and a hash table of the storage deduplication has shared (shared_cap
+   slots, a power of two) and whether load_program runs a pass
+   and seg_hash, parallel to the segment table: the content hash a pass
+   computed for a segment, kept while the segment is not stored to, or 0
+   if it has none
+   and zero_map, the file mapping segment 0's words live in when it was
+   loaded from a native image (NULL when the slab owns them)
+   and zero_stream, the load still filling zero_map when segment 0 is
+   streamed in (segment 0's len is then the words that have arrived) */
 struct Memory_T {
+        Segment *segments;
+        uint32_t seg_count;
+        uint32_t seg_cap;
         uint32_t *free;
-        uint32_t *segments;
-        //Seq_T free;
-        //Seq_T segments;
+        uint32_t free_count;
+        uint32_t free_cap;
+        Slab_T slab;
+        uint32_t zero_alias;
+        uint8_t *zero_watch;
+        uint32_t zero_watch_len;
+        uint32_t *zero_dirty;
+        uint32_t zero_dirty_count;
+        uint32_t zero_dirty_cap;
+        uint32_t live_segments;
+        uint64_t live_words;
+        uint64_t peak_words;
+        uint64_t max_words;
+        Shared_ref *shared;
+        uint32_t shared_cap;
+        uint32_t shared_count;
+        int dedup;
+        uint64_t *seg_hash;
+        void *zero_map;
+        size_t zero_map_bytes;
+        Zero_stream *zero_stream;
 };
 
 /* Struct definition of a UM_T which 
-   contains two structs: 
-   - Register_T representing the registers
-   - Memory_T representing segmented memory */
+   contains: 
+   - a flat array of the eight registers, read directly by the handlers
+   - Memory_T representing segmented memory
+   and the predecoded copy of segment zero (NULL until um_execute
+   allocates it, and again after load_program replaces segment zero),
+   code_len + 1 entries from um_zero_alloc
+   and the bytes OUT has buffered, written out with um_flush according
+   to the flush policy
+   and the input IN has yet to take, from in_next to in_end: read ahead
+   into in, or all of standard input mapped at in_map when it is a
+   regular file; in_eof once the end of input has been reached */
 struct UM_T {
-    Registers_T reg;
+    uint32_t regs[NUM_REGISTERS];
     Memory_T mem;
+    Um_decoded *code;
+    uint32_t code_len;
+    Um_flush flush;
+    uint32_t out_len;
+    uint8_t out[OUT_BUFFER_BYTES];
+    const uint8_t *in_next;
+    const uint8_t *in_end;
+    void *in_map;
+    size_t in_map_bytes;
+    int in_eof;
+    uint8_t in[IN_BUFFER_BYTES];
 };
 
-/* Creates/frees memory associated with a Registers_T */
+/* Creates/frees memory associated with a Registers_T
+   (standalone register file kept for the unit tests; the UM itself
+   uses the regs array in struct UM_T) */
 Registers_T registers_new();
 void registers_free(Registers_T *r);
 
@@ -58,17 +209,23 @@ uint32_t registers_get(Registers_T r, uint32_t num_register);
 UM_T um_new(uint32_t length);
 void um_free(UM_T *um);
 
-// CARRAY
-uint32_t arr_size(uint32_t arr[]);
-void arr_addhi(uint32_t *arr[], uint32_t element);
-void arr_addlo(uint32_t *arr[], uint32_t element);
-void arr_remhi(uint32_t *arr[]);
-void arr_remlo(uint32_t *arr[]);
-void arr_resize(uint32_t *arr[]);
+/* Zeroed arrays sized by segment zero, which get pages of their own
+   when large so that replacing segment zero does not clear them; free
+   with the size they were allocated with */
+void *um_zero_alloc(size_t bytes);
+void um_zero_free(void *ptr, size_t bytes);
 
+/* Writes the bytes OUT has buffered to standard output */
+void um_flush(UM_T um);
+
+/* Gets IN more input; 0 at the end of input */
+int um_fill_input(UM_T um);
 
 /* Executes passed in program */
 void um_execute(UM_T um);
+void um_execute_at(UM_T um, uint32_t prog_counter);
+void um_decode_seg_zero(UM_T um);
+void um_patch_code(UM_T um, uint32_t off, uint32_t word);
 void instruction_call(UM_T um, Um_opcode op, uint32_t ra, 
               uint32_t rb, uint32_t rc);
 //void populate(UM_T um, uint32_t index, uint32_t word);
@@ -81,10 +238,41 @@ void memory_free(Memory_T *m);
 void memory_put(Memory_T m, uint32_t seg, uint32_t off, uint32_t val);
 uint32_t memory_get(Memory_T m, uint32_t seg, uint32_t off);
 
-/* Maps and Unmaps segments to Memory_T sequence */
+/* Maps and Unmaps segments to the Memory_T segment table */
 uint32_t memory_map(Memory_T m, uint32_t length);
 void     memory_unmap(Memory_T m, uint32_t seg_num);
 
+/* Limits the words MAP may leave mapped (0 for no limit), and prints the
+   memory counters */
+void memory_set_quota(Memory_T m, uint64_t max_words);
+void memory_report(Memory_T m, FILE *out);
+
+/* Merges segments whose contents match and that have not been written
+   since the previous pass; set_dedup makes load_program run a pass */
+void memory_dedup(Memory_T m);
+void memory_set_dedup(Memory_T m, int on);
+
+/* Gives segment 0 a private copy of storage it shares with another segment */
+void memory_unshare_zero(Memory_T m);
+
+/* Makes "length" words inside a private file mapping of "bytes" bytes
+   segment 0; the mapping is unmapped once segment 0 lets go of it */
+void memory_adopt_zero(Memory_T m, void *map, size_t bytes,
+                       uint32_t *words, uint32_t length);
+
+/* Makes a mapping that stream fills from its start segment 0, and waits
+   until segment 0 has at least "words" words or the stream has ended
+   (UINT32_MAX waits for all of it) */
+void memory_stream_zero(Memory_T m, void *map, size_t bytes,
+                        Zero_stream *stream);
+void memory_await_zero(Memory_T m, uint32_t words);
+
+/* Write barrier on segment 0: watch a word, and take back (and stop
+   watching) words written since they were watched */
+void memory_reset_zero_watch(Memory_T m);
+void memory_watch_zero(Memory_T m, uint32_t off);
+int  memory_take_zero_dirty(Memory_T m, uint32_t *off);
+
 uint32_t  load_program(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc);
 
 
@@ -102,7 +290,7 @@ uint32_t  load_program(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc);
  */
 static inline void populate(UM_T um, uint32_t index, uint32_t word)
 {
-    assert(um != NULL);
+    UM_ASSERT(um != NULL);
     memory_put(um->mem, 0, index, word);
 }
 
@@ -116,11 +304,11 @@ static inline void populate(UM_T um, uint32_t index, uint32_t word)
  */
 static inline void conditional_move(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
 
-    if (registers_get(um->reg, rc) != 0) {
-        registers_put(um->reg, ra, registers_get(um->reg, rb));
+    if (um->regs[rc] != 0) {
+        um->regs[ra] = um->regs[rb];
     }
 }
 
@@ -128,36 +316,61 @@ static inline void conditional_move(UM_T um, uint32_t ra, uint32_t rb, uint32_t
  * Input: UM_T struct; uint32_t's reprsenting registers A, B, C
  * Output: N/A
  * Does: register a gets value of segment(val in rb) at offset(val in rc)
+ *       An in-bounds load reads the segment table directly; anything
+ *       else goes through memory_get to be checked
  * Error: Asserts if UM_T struct is NULL
  *        Asserts if any register number is valid
  */
 static inline void segmented_load(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
 
-    uint32_t rb_val = registers_get(um->reg, rb);
-    uint32_t rc_val = registers_get(um->reg, rc);
+    uint32_t rb_val = um->regs[rb];
+    uint32_t rc_val = um->regs[rc];
+    Memory_T m = um->mem;
 
-    registers_put(um->reg, ra, memory_get(um->mem, rb_val, rc_val));
+    /* Unmapped segments have length 0, so they never pass */
+    if (rb_val < m->seg_count && rc_val < m->segments[rb_val].len) {
+        um->regs[ra] = m->segments[rb_val].data[rc_val];
+        return;
+    }
+
+    um->regs[ra] = memory_get(m, rb_val, rc_val);
 }
 
  /* Name: segmented_store
  * Input: UM_T struct; uint32_t's reprsenting registers A, B, C
  * Output: N/A
  * Does: stores val in rc in segment(val in ra) at offset(val in rb)
+ *       Stores into segment zero also invalidate that word in um->code
+ *       An in-bounds store to a segment whose store_len allows it writes
+ *       the segment table directly
  * Error: Asserts if UM_T struct is NULL
  *        Asserts if any register number is valid
  */
 static inline void segmented_store(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
+
+    uint32_t ra_val = um->regs[ra];
+    uint32_t rb_val = um->regs[rb];
+    uint32_t rc_val = um->regs[rc];
+    Memory_T m = um->mem;
+
+    /* Segment 0 and shared storage need the barrier and copy-on-write */
+    if (ra_val < m->seg_count && rb_val < m->segments[ra_val].store_len) {
+        m->segments[ra_val].data[rb_val] = rc_val;
+        return;
+    }
 
-    uint32_t ra_val = registers_get(um->reg, ra);
-    uint32_t rb_val = registers_get(um->reg, rb);
+    memory_put(m, ra_val, rb_val, rc_val);
 
-    memory_put(um->mem, ra_val, rb_val, registers_get(um->reg, rc));
+    /* Keep the predecoded copy in sync with self-modifying code */
+    if (ra_val == 0) {
+        um_patch_code(um, rb_val, rc_val);
+    }
 }
 
 /* Name: add
@@ -169,13 +382,13 @@ static inline void segmented_store(UM_T um, uint32_t ra, uint32_t rb, uint32_t r
  */
 static inline void add(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
 
-    uint32_t rb_val = registers_get(um->reg, rb);
-    uint32_t rc_val = registers_get(um->reg, rc);
+    uint32_t rb_val = um->regs[rb];
+    uint32_t rc_val = um->regs[rc];
 
-    registers_put(um->reg, ra, (rb_val + rc_val));
+    um->regs[ra] = (rb_val + rc_val);
 }
 
 /* Name: multiply
@@ -187,13 +400,13 @@ static inline void add(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
  */
 static inline void multiply(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
 
-    uint32_t rb_val = registers_get(um->reg, rb);
-    uint32_t rc_val = registers_get(um->reg, rc);
+    uint32_t rb_val = um->regs[rb];
+    uint32_t rc_val = um->regs[rc];
 
-    registers_put(um->reg, ra, (rb_val * rc_val));       
+    um->regs[ra] = (rb_val * rc_val);       
 }
 
 /* Name: divide
@@ -205,14 +418,14 @@ static inline void multiply(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
  */
 static inline void divide(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
 
-    uint32_t rb_val = registers_get(um->reg, rb);
-    uint32_t rc_val = registers_get(um->reg, rc);
-    assert(rc_val != 0);
+    uint32_t rb_val = um->regs[rb];
+    uint32_t rc_val = um->regs[rc];
+    UM_CHECK(rc_val != 0);
 
-    registers_put(um->reg, ra, (rb_val / rc_val));
+    um->regs[ra] = (rb_val / rc_val);
 }
 
 /* Name: nand
@@ -225,13 +438,13 @@ static inline void divide(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
  */
 static inline void nand(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
 
-    uint32_t rb_val = registers_get(um->reg, rb);
-    uint32_t rc_val = registers_get(um->reg, rc);
+    uint32_t rb_val = um->regs[rb];
+    uint32_t rc_val = um->regs[rc];
 
-    registers_put(um->reg, ra, ~(rb_val & rc_val));
+    um->regs[ra] = ~(rb_val & rc_val);
 }
 
 /* Name: halt
@@ -243,8 +456,8 @@ static inline void nand(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
  */
 static inline void halt(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
     
     um_free(&um);
     exit(EXIT_SUCCESS);
@@ -260,13 +473,13 @@ static inline void halt(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
  */
 static inline void map_segment(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
 
-    uint32_t rc_val = registers_get(um->reg, rc);
+    uint32_t rc_val = um->regs[rc];
 
     uint32_t index = memory_map(um->mem, rc_val);
-    registers_put(um->reg, rb, index);
+    um->regs[rb] = index;
 }
 
 /* Name: unmap_segment
@@ -278,10 +491,10 @@ static inline void map_segment(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
  */
 static inline void unmap_segment(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
 
-    uint32_t rc_val = registers_get(um->reg, rc);
+    uint32_t rc_val = um->regs[rc];
 
     memory_unmap(um->mem, rc_val);
 }
@@ -290,43 +503,49 @@ static inline void unmap_segment(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
  * Input: UM_T struct; uint32_t's reprsenting registers A, B, C
  * Output: N/A
  * Does: outputs the value in rc
+ *       The byte goes in um->out; a full buffer, or a newline under
+ *       FLUSH_LINE, writes it out
  * Error: Asserts if UM_T struct is NULL
  *        Asserts if any register number is valid
  *        Asserts if value in rc is not valid (not between 0 to 255 inclusive)
  */
 static inline void output(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
 
-    uint32_t rc_val = registers_get(um->reg, rc);
-    assert(rc_val < 256);
+    uint32_t rc_val = um->regs[rc];
+    UM_CHECK(rc_val < 256);
 
-    putchar(rc_val);
+    um->out[um->out_len++] = rc_val;
+    if (um->out_len == OUT_BUFFER_BYTES ||
+        (rc_val == '\n' && um->flush == FLUSH_LINE)) {
+        um_flush(um);
+    }
 }
 
 /* Name: input
  * Input: UM_T struct; uint32_t's reprsenting registers A, B, C
  * Output: N/A
  * Does: takes in input from stdin and loads val into rc
+ *       Bytes come from the read-ahead buffer, refilled by um_fill_input
+ *       only when it runs dry
  *       If end of input is signalled,
  *            rc gets 32-bit word in which every bit is 1 (~0)
  * Error: Asserts if UM_T struct is NULL
  *        Asserts if any register number is valid
- * Note: since we used fgetc, the inputted value can never be greater than 255
  */
 static inline void input(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc) 
 {
-    assert(um != NULL);
-    assert(ra < 8 && rb < 8 && rc < 8);
-
-    int character = fgetc(stdin);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8 && rb < 8 && rc < 8);
 
-    if (character == EOF) {
-        registers_put(um->reg, rc, ~0);
+    if (um->in_next == um->in_end && !um_fill_input(um)) {
+        um->regs[rc] = ~0u;
+        return;
     }
 
-    registers_put(um->reg, rc, character);
+    um->regs[rc] = *um->in_next++;
 }
 
 /* Name: load_value
@@ -338,10 +557,10 @@ static inline void input(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc)
  */
 static inline void load_value(UM_T um, uint32_t ra, uint32_t val)
 {
-    assert(um != NULL);
-    assert(ra < 8);
+    UM_ASSERT(um != NULL);
+    UM_ASSERT(ra < 8);
 
-    registers_put(um->reg, ra, val);
+    um->regs[ra] = val;
 }
 
 // void      segmented_load(UM_T um, uint32_t ra, uint32_t rb, uint32_t rc);
@@ -0,0 +1,227 @@
+/*
+ * um2c: ahead-of-time translator from a .um file to C.
+ * Reads the image through the same loader as the driver and writes a
+ * C program with one label per instruction to stdout. The program embeds
+ * the image, links against um.o for memory and I/O, and runs the
+ * translated code:
+ *   - LOADP from segment zero jumps through a table of label addresses,
+ *     or straight to a label when an LV just before it gave the target
+ *   - a store into segment zero that changes a word of the image marks
+ *     the AOT_PAGE_WORDS page holding it dirty, and code in a dirty page
+ *     runs one instruction at a time from memory (at the step label)
+ *     until control reaches a clean page again
+ *   - LOADP from any other segment or an invalid opcode hands the rest
+ *     of the run to um_execute_at
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "um.h"
+#include "loader.h"
+
+/* Granularity of the dirty bits: the translated code checks the bit on
+   entering each page, so smaller pages cost more checks but step through
+   less code when a program keeps data next to its code */
+#define AOT_PAGE_SHIFT 4
+#define AOT_PAGE_WORDS (1u << AOT_PAGE_SHIFT)
+
+/* Name: emit_instruction
+ * Input: output file, the image, its length and an index into it
+ * Output: N/A
+ * Does: Writes the label and C statements for the instruction at pc,
+ *       led by the dirty check when pc starts a page
+ */
+static void emit_instruction(FILE *out, const uint32_t *words, uint32_t len,
+                             uint32_t pc)
+{
+    uint32_t word = words[pc];
+    uint32_t op = word >> OP_LSB;
+    uint32_t a = (word >> RA_LSB) & R_MASK;
+    uint32_t b = (word >> RB_LSB) & R_MASK;
+    uint32_t c = (word >> RC_LSB) & R_MASK;
+
+    fprintf(out, "L%u:\n", pc);
+    if (pc % AOT_PAGE_WORDS == 0) {
+        fprintf(out, "    if (dirty[%u]) { pc = %u; goto step; }\n",
+                pc >> AOT_PAGE_SHIFT, pc);
+    }
+
+    switch (op) {
+    case CMOV:
+        fprintf(out, "    if (r[%u] != 0) r[%u] = r[%u];\n", c, a, b);
+        break;
+    case SLOAD:
+        fprintf(out, "    segmented_load(um, %u, %u, %u);\n", a, b, c);
+        break;
+    case SSTORE:
+        /* Only a store that changes translated code makes its page
+           dirty, which matters here if it is the page that runs next */
+        fprintf(out, "    if (r[%u] == 0 && r[%u] < %u && "
+                     "r[%u] != image[r[%u]]) dirty[r[%u] >> %u] = 1;\n"
+                     "    segmented_store(um, %u, %u, %u);\n"
+                     "    if (dirty[%u]) { pc = %u; goto step; }\n",
+                a, b, len, c, b, b, AOT_PAGE_SHIFT, a, b, c,
+                (pc + 1) >> AOT_PAGE_SHIFT, pc + 1);
+        break;
+    case ADD:
+        fprintf(out, "    r[%u] = r[%u] + r[%u];\n", a, b, c);
+        break;
+    case MUL:
+        fprintf(out, "    r[%u] = r[%u] * r[%u];\n", a, b, c);
+        break;
+    case DIV:
+        fprintf(out, "    divide(um, %u, %u, %u);\n", a, b, c);
+        break;
+    case NAND:
+        fprintf(out, "    r[%u] = ~(r[%u] & r[%u]);\n", a, b, c);
+        break;
+    case HALT:
+        fprintf(out, "    halt(um, %u, %u, %u);\n", a, b, c);
+        break;
+    case MAP:
+        fprintf(out, "    map_segment(um, %u, %u, %u);\n", a, b, c);
+        break;
+    case UNMAP:
+        fprintf(out, "    unmap_segment(um, %u, %u, %u);\n", a, b, c);
+        break;
+    case OUT:
+        fprintf(out, "    output(um, %u, %u, %u);\n", a, b, c);
+        break;
+    case IN:
+        fprintf(out, "    input(um, %u, %u, %u);\n", a, b, c);
+        break;
+    case LOADP:
+        fprintf(out, "    if (r[%u] != 0) { pc = load_program(um, %u, %u, "
+                     "%u); goto fallback; }\n"
+                     "    pc = r[%u];\n", b, a, b, c, c);
+
+        /* Target known from the LV right before: a guarded direct goto */
+        if (pc > 0 && words[pc - 1] >> OP_LSB == LV &&
+            ((words[pc - 1] >> LV_RA_LSB) & R_MASK) == c &&
+            (words[pc - 1] & LV_VALUE_MASK) < len) {
+            uint32_t target = words[pc - 1] & LV_VALUE_MASK;
+            fprintf(out, "    if (pc == %u && !dirty[%u]) goto L%u;\n",
+                    target, target >> AOT_PAGE_SHIFT, target);
+        }
+        fprintf(out, "    goto dispatch;\n");
+        break;
+    case LV:
+        fprintf(out, "    r[%u] = %u;\n", (word >> LV_RA_LSB) & R_MASK,
+                word & LV_VALUE_MASK);
+        break;
+    default:
+        fprintf(out, "    pc = %u;\n    goto fallback;\n", pc);
+        break;
+    }
+}
+
+/* Name: emit_program
+ * Input: output file, name of the source image, the image and its length
+ * Output: N/A
+ * Does: Writes the whole translated C program
+ */
+static void emit_program(FILE *out, const char *path, const uint32_t *words,
+                         uint32_t len)
+{
+    fprintf(out, "/* Generated by um2c from %s; do not edit */\n\n"
+                 "#include <assert.h>\n#include <stdio.h>\n"
+                 "#include <stdlib.h>\n#include \"um.h\"\n\n", path);
+
+    /* One spare entry so an empty image still gives valid arrays */
+    fprintf(out, "static const uint32_t image[%u] = {", len + 1);
+    for (uint32_t pc = 0; pc < len; pc++) {
+        fprintf(out, "%s0x%08x,", pc % 6 == 0 ? "\n    " : " ", words[pc]);
+    }
+    fprintf(out, "\n    0\n};\n\n");
+
+    fprintf(out, "int main(void)\n{\n"
+                 "    static void *const labels[%u] = {", len + 1);
+    for (uint32_t pc = 0; pc < len; pc++) {
+        fprintf(out, "\n        __extension__ &&L%u,", pc);
+    }
+    fprintf(out, "\n        __extension__ &&done\n    };\n\n");
+
+    /* One dirty bit per page, set once a store changes a word in it */
+    fprintf(out, "    static unsigned char dirty[%u];\n",
+            (len >> AOT_PAGE_SHIFT) + 1);
+
+    fprintf(out, "    UM_T um = um_new(%u);\n"
+                 "    uint32_t *r = um->regs;\n"
+                 "    uint32_t pc;\n\n"
+                 "    for (pc = 0; pc < %u; pc++) {\n"
+                 "        populate(um, pc, image[pc]);\n"
+                 "    }\n\n"
+                 "    pc = 0;\n"
+                 "    goto dispatch;\n\n", len, len);
+
+    for (uint32_t pc = 0; pc < len; pc++) {
+        emit_instruction(out, words, len, pc);
+    }
+
+    fprintf(out, "    goto done;\n\n"
+                 "dispatch:\n"
+                 "    if (pc >= %u) goto done;\n"
+                 "    if (dirty[pc >> %u]) goto step;\n"
+                 "    __extension__ ({ goto *labels[pc]; });\n\n",
+            len, AOT_PAGE_SHIFT);
+
+    /* Dirty pages run from memory, as the words there are now */
+    fprintf(out, "step:\n"
+                 "    while (pc < %u && dirty[pc >> %u]) {\n"
+                 "        uint32_t word = memory_get(um->mem, 0, pc);\n"
+                 "        uint32_t op = word >> OP_LSB;\n"
+                 "        uint32_t a = (word >> RA_LSB) & R_MASK;\n"
+                 "        uint32_t b = (word >> RB_LSB) & R_MASK;\n"
+                 "        uint32_t c = (word >> RC_LSB) & R_MASK;\n\n"
+                 "        if (op == LV) {\n"
+                 "            r[(word >> LV_RA_LSB) & R_MASK] = "
+                 "word & LV_VALUE_MASK;\n"
+                 "            pc++;\n"
+                 "        } else if (op == LOADP) {\n"
+                 "            if (r[b] != 0) {\n"
+                 "                pc = load_program(um, a, b, c);\n"
+                 "                goto fallback;\n"
+                 "            }\n"
+                 "            pc = r[c];\n"
+                 "        } else if (op > LV) {\n"
+                 "            goto fallback;\n"
+                 "        } else {\n"
+                 "            if (op == SSTORE && r[a] == 0 && r[b] < %u && "
+                 "r[c] != image[r[b]]) {\n"
+                 "                dirty[r[b] >> %u] = 1;\n"
+                 "            }\n"
+                 "            instruction_call(um, op, a, b, c);\n"
+                 "            pc++;\n"
+                 "        }\n"
+                 "    }\n"
+                 "    goto dispatch;\n"
+                 "fallback:\n"
+                 "    um_execute_at(um, pc);\n",
+            len, AOT_PAGE_SHIFT, len, AOT_PAGE_SHIFT);
+    fprintf(out, "done:\n"
+                 "    (void)r;\n"
+                 "    um_free(&um);\n"
+                 "    return EXIT_SUCCESS;\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: ./um2c <Um file> > <C file>\n");
+        return EXIT_FAILURE;
+    }
+
+    uint32_t size;
+    uint32_t *words = um_load_words(argv[1], &size);
+    if (words == NULL) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    emit_program(stdout, argv[1], words, size);
+
+    free(words);
+    return EXIT_SUCCESS;
+}
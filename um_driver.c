@@ -1,11 +1,109 @@
 /*
  * Driver file for UM Implementation.
- * The driver opens the provided .um file,
- * creates a UM_T struct,
- * reads in all instructions from given file,
- * and populates segment zero with all instructions.
+ * The driver parses the options, loads the provided .um file
+ * into a new UM_T struct (see loader.h) and runs it.
  *
  */
 
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "um.h"
+#include "loader.h"
+#include "jit.h"
+#include "tailcall.h"
 
+int main(int argc, char *argv[]) 
+{
+    void (*execute)(UM_T um) = um_execute;
+    uint32_t release_words = 0;
+    uint64_t max_words = 0;
+    const char *spill_path = NULL;
+    uint64_t spill_words = 0;
+    int dedup = 0;
+    int stream = 0;
+    int flush = -1;
+    int arg = 1;
 
+    for (; arg < argc - 1; arg++) {
+        if (strcmp(argv[arg], "--jit") == 0) {
+            execute = jit_execute;
+        } else if (strcmp(argv[arg], "--tailcall") == 0) {
+            execute = tail_execute;
+        } else if (strcmp(argv[arg], "--checked") == 0) {
+            um_checked = 1;
+        } else if (strncmp(argv[arg], "--release=", 10) == 0) {
+            release_words = strtoul(argv[arg] + 10, NULL, 10);
+        } else if (strncmp(argv[arg], "--max-mem=", 10) == 0) {
+            max_words = strtoull(argv[arg] + 10, NULL, 10);
+        } else if (strcmp(argv[arg], "--stats") == 0) {
+            um_stats = 1;
+        } else if (strcmp(argv[arg], "--dedup") == 0) {
+            dedup = 1;
+        } else if (strcmp(argv[arg], "--stream") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[arg], "--flush=full") == 0) {
+            flush = FLUSH_FULL;
+        } else if (strcmp(argv[arg], "--flush=line") == 0) {
+            flush = FLUSH_LINE;
+        } else if (strcmp(argv[arg], "--flush=none") == 0) {
+            flush = FLUSH_NONE;
+        } else if (strncmp(argv[arg], "--spill=", 8) == 0) {
+            spill_path = argv[arg] + 8;
+        } else if (strncmp(argv[arg], "--spill-after=", 14) == 0) {
+            spill_words = strtoull(argv[arg] + 14, NULL, 10);
+        } else {
+            break;
+        }
+    }
+
+    if (arg != argc - 1) {
+        fprintf(stderr, "Usage: ./um [--jit | --tailcall] [--checked] "
+                        "[--release=<words>] [--max-mem=<words>] "
+                        "[--stats] [--dedup] [--stream] "
+                        "[--flush=line|full|none] "
+                        "[--spill=<file> [--spill-after=<words>]] "
+                        "<Um file | ->\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Standard input can only be streamed */
+    const char *path = argv[arg];
+    if (strcmp(path, "-") == 0) {
+        stream = 1;
+    }
+
+    UM_T um = stream ? um_stream(path) : um_load(path);
+    if (um == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    if (release_words != 0) {
+        slab_set_release(um->mem->slab, release_words);
+    }
+    if (flush >= 0) {
+        um->flush = flush;
+    }
+    memory_set_quota(um->mem, max_words);
+    memory_set_dedup(um->mem, dedup);
+
+    if (spill_path != NULL &&
+        slab_set_spill(um->mem->slab, spill_path,
+                       spill_words * sizeof(uint32_t)) != 0) {
+        perror(spill_path);
+        um_free(&um);
+        return EXIT_FAILURE;
+    }
+
+    /* Only um_execute copes with segment 0 still arriving */
+    if (execute != um_execute) {
+        memory_await_zero(um->mem, UINT32_MAX);
+    }
+    execute(um);
+
+    um_free(&um);
+
+    return EXIT_SUCCESS;
+}
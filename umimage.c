@@ -0,0 +1,62 @@
+/*
+ * umimage: converts a .um file to a native image (see loader.h) on
+ * stdout. The driver maps an image as segment zero as it is, so batch
+ * runs of the same program skip decoding it every time. Images hold host
+ * order words, so they only run on hosts with the byte order of the one
+ * that made them.
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "um.h"
+#include "loader.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: ./umimage <Um file> > <image file>\n");
+        return EXIT_FAILURE;
+    }
+
+    uint32_t size;
+    uint32_t *words = um_load_words(argv[1], &size);
+    if (words == NULL) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    /* Records where the image came from, NUL padded to whole words */
+    size_t name_len = strlen(argv[1]);
+    Um_image_section source = { UM_IMAGE_SOURCE,
+                                name_len / sizeof(uint32_t) + 1 };
+    char *name = calloc(source.words, sizeof(uint32_t));
+    assert(name != NULL);
+    memcpy(name, argv[1], name_len);
+
+    Um_image_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UM_IMAGE_MAGIC, sizeof(header.magic));
+    header.byte_order = UM_IMAGE_BYTE_ORDER;
+    header.words = size;
+    header.sections = 1;
+
+    int ok = fwrite(&header, sizeof(header), 1, stdout) == 1 &&
+             fwrite(words, sizeof(*words), size, stdout) == size &&
+             fwrite(&source, sizeof(source), 1, stdout) == 1 &&
+             fwrite(name, sizeof(uint32_t), source.words, stdout) ==
+                 source.words &&
+             fflush(stdout) == 0;
+
+    free(name);
+    free(words);
+
+    if (!ok) {
+        perror("umimage");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -145,6 +145,61 @@ extern void Um_write_sequence(FILE *output, Seq_T stream)
     }
 }
 
+/* Loads any 32-bit word into register a, with b as scratch: load value
+ * only takes 25 bits, so it goes in as word / 128 * 128 + word % 128
+ */
+static void emit_word(Seq_T stream, Um_register a, Um_register b,
+                      Um_instruction word)
+{
+    emit(stream, loadval(a, word >> 7));
+    emit(stream, loadval(b, 1 << 7));
+    emit(stream, multiply(a, a, b));
+    emit(stream, loadval(b, word & 0x7f));
+    emit(stream, add(a, a, b));
+}
+
+/* Replaces the instruction at index with a load value, for jump targets
+ * that are only known once the code after it has been emitted
+ */
+static void patch_loadval(Seq_T stream, int index, unsigned ra, unsigned val)
+{
+    Seq_put(stream, index, (void *)(uintptr_t)loadval(ra, val));
+}
+
+/* Maps a segment of seg_len words into r6 and copies all of segment 0
+ * into it, so the program can go on running from either. seg_len must be
+ * at least the program's length, and the load value at the index returned
+ * must be patched (into r1) with that length once it is known
+ */
+static int emit_copy_self(Seq_T stream, unsigned seg_len)
+{
+    emit(stream, loadval(r1, seg_len));
+    emit(stream, mapseg(r0, r6, r1));
+    int to_len = Seq_length(stream);
+    emit(stream, loadval(r1, 0));
+
+    /* r4 = -length, so r2 + r4 is 0 once r2 reaches the length */
+    emit(stream, nand(r4, r1, r1));
+    emit(stream, loadval(r3, 1));
+    emit(stream, add(r4, r4, r3));
+    emit(stream, loadval(r2, 0));
+
+    int loop = Seq_length(stream);
+    emit(stream, segload(r3, r0, r2));
+    emit(stream, segstore(r6, r2, r3));
+    emit(stream, loadval(r3, 1));
+    emit(stream, add(r2, r2, r3));
+    emit(stream, add(r5, r2, r4));
+    int to_done = Seq_length(stream);
+    emit(stream, loadval(r3, 0));
+    emit(stream, loadval(r7, loop));
+    emit(stream, conditional_move(r3, r7, r5));
+    emit(stream, load_program(r0, r0, r3));
+
+    patch_loadval(stream, to_done, r3, Seq_length(stream));
+    return to_len;
+}
+
 /* Unit tests for the UM */
 
 void emit_halt_test(Seq_T stream)
@@ -552,3 +607,320 @@ void emit_arithmetic_test(Seq_T stream)
     emit(stream, output(r0));
     emit(stream, halt());
 }
+
+/* Test that segment 0 stays current when unmapping the segment it was
+ * loaded from gives it a copy of its own: with --dedup, the identical
+ * segments in r6 and r7 share storage, so unmapping r7 after loading it
+ * copies segment 0. A store into r6 must then not show up in segment 0,
+ * which still prints "k". r4 holds a third copy to start from.
+ */
+void emit_dedup_unmap_test(Seq_T stream)
+{
+    Um_instruction code[] = {
+        loadval(r1, 2),
+        load_program(r0, r7, r1),   /* running in r4: load r7 at 2 */
+        unmap(r0, r0, r7),
+        loadval(r1, 12),
+        segload(r3, r0, r1),
+        loadval(r1, 7),
+        segstore(r6, r1, r3),       /* word 12 into word 7 of r6 */
+        loadval(r2, 'k'),
+        output(r2),
+        loadval(r2, '\n'),
+        output(r2),
+        halt(),
+        loadval(r2, '!')
+    };
+    unsigned ncode = sizeof(code) / sizeof(code[0]);
+
+    /* Jump over the code, which starts at word 2 */
+    emit(stream, loadval(r1, ncode + 2));
+    emit(stream, load_program(r0, r0, r1));
+    for (unsigned i = 0; i < ncode; i++) {
+        emit(stream, code[i]);
+    }
+
+    /* Copy it into three segments long enough to be deduplicated */
+    emit(stream, loadval(r1, 64));
+    emit(stream, mapseg(r0, r6, r1));
+    emit(stream, mapseg(r0, r7, r1));
+    emit(stream, mapseg(r0, r4, r1));
+    for (unsigned i = 0; i < ncode; i++) {
+        emit(stream, loadval(r2, i + 2));
+        emit(stream, segload(r3, r0, r2));
+        emit(stream, loadval(r2, i));
+        emit(stream, segstore(r6, r2, r3));
+        emit(stream, segstore(r7, r2, r3));
+        emit(stream, segstore(r4, r2, r3));
+    }
+
+    emit(stream, loadval(r1, 0));
+    emit(stream, load_program(r0, r4, r1));
+}
+
+/* Test that output from before a fault is not lost: prints "A" and a
+ * newline, then divides by zero
+ */
+void emit_div_fault_test(Seq_T stream)
+{
+    emit(stream, loadval(r1, 'A'));
+    emit(stream, output(r1));
+    emit(stream, loadval(r1, '\n'));
+    emit(stream, output(r1));
+    emit(stream, loadval(r2, 0));
+    emit(stream, divide(r3, r1, r2));
+    emit(stream, output(r1));
+    emit(stream, halt());
+}
+
+/* Test that an invalid opcode faults after writing out earlier output,
+ * also in builds without checks
+ */
+void emit_invalid_fault_test(Seq_T stream)
+{
+    emit(stream, loadval(r1, 'C'));
+    emit(stream, output(r1));
+    emit(stream, loadval(r1, '\n'));
+    emit(stream, output(r1));
+    emit(stream, three_register(LV + 1, 0, 0, 0));
+    emit(stream, output(r1));
+    emit(stream, halt());
+}
+
+/* Test self-modifying code: the block at 0 prints r1 and runs once with
+ * the load value it starts with ('a'), then once more after that load
+ * value has been overwritten with one of 'b'. r7 says which time it is
+ */
+void emit_smc_block_test(Seq_T stream)
+{
+    emit(stream, loadval(r1, 'a'));
+    emit(stream, output(r1));
+    int to_patch = Seq_length(stream);
+    emit(stream, loadval(r5, 0));
+    int to_end = Seq_length(stream);
+    emit(stream, loadval(r6, 0));
+    emit(stream, conditional_move(r5, r6, r7));
+    emit(stream, load_program(r0, r0, r5));
+
+    /* Overwrite word 0 and run the block again */
+    patch_loadval(stream, to_patch, r5, Seq_length(stream));
+    emit(stream, loadval(r7, 1));
+    emit_word(stream, r2, r3, loadval(r1, 'b'));
+    emit(stream, loadval(r4, 0));
+    emit(stream, segstore(r0, r4, r2));
+    emit(stream, loadval(r4, 0));
+    emit(stream, load_program(r0, r0, r4));
+
+    /* Outputting newline and halting */
+    patch_loadval(stream, to_end, r6, Seq_length(stream));
+    emit(stream, loadval(r0, '\n'));
+    emit(stream, output(r0));
+    emit(stream, halt());
+}
+
+/* Test self-modifying code in a superinstruction: words 1 and 2 (load
+ * value, then add, which um_execute fuses) print 'a', then 'b' once the
+ * load value is overwritten, then 'c' once the add is overwritten with
+ * one of r7 = 1. r5 says where to go after each time
+ */
+void emit_smc_fused_test(Seq_T stream)
+{
+    int to_first = Seq_length(stream);
+    emit(stream, loadval(r5, 0));
+    emit(stream, loadval(r1, 'a'));
+    emit(stream, add(r1, r1, r4));
+    emit(stream, output(r1));
+    emit(stream, load_program(r0, r0, r5));
+
+    /* Overwrite the first word of the pair */
+    patch_loadval(stream, to_first, r5, Seq_length(stream));
+    int to_second = Seq_length(stream);
+    emit(stream, loadval(r5, 0));
+    emit_word(stream, r2, r3, loadval(r1, 'b'));
+    emit(stream, loadval(r6, 1));
+    emit(stream, segstore(r0, r6, r2));
+    emit(stream, loadval(r6, 1));
+    emit(stream, load_program(r0, r0, r6));
+
+    /* Overwrite the second word of the pair */
+    patch_loadval(stream, to_second, r5, Seq_length(stream));
+    int to_end = Seq_length(stream);
+    emit(stream, loadval(r5, 0));
+    emit_word(stream, r2, r3, add(r1, r1, r7));
+    emit(stream, loadval(r7, 1));
+    emit(stream, loadval(r6, 2));
+    emit(stream, segstore(r0, r6, r2));
+    emit(stream, loadval(r6, 1));
+    emit(stream, load_program(r0, r0, r6));
+
+    /* Outputting newline and halting */
+    patch_loadval(stream, to_end, r5, Seq_length(stream));
+    emit(stream, loadval(r0, '\n'));
+    emit(stream, output(r0));
+    emit(stream, halt());
+}
+
+/* Test that storing a word of segment 0 over itself changes nothing and
+ * that a real change afterwards is still seen: the block at 1 prints 'a',
+ * 'a' again after its load value is stored back unchanged, then 'b' once
+ * it is overwritten. r5 says where to go after each time
+ */
+void emit_smc_same_test(Seq_T stream)
+{
+    int to_same = Seq_length(stream);
+    emit(stream, loadval(r5, 0));
+    emit(stream, loadval(r1, 'a'));
+    emit(stream, output(r1));
+    emit(stream, load_program(r0, r0, r5));
+
+    /* Store word 1 back as it is */
+    patch_loadval(stream, to_same, r5, Seq_length(stream));
+    int to_change = Seq_length(stream);
+    emit(stream, loadval(r5, 0));
+    emit(stream, loadval(r6, 1));
+    emit(stream, segload(r2, r0, r6));
+    emit(stream, segstore(r0, r6, r2));
+    emit(stream, loadval(r6, 1));
+    emit(stream, load_program(r0, r0, r6));
+
+    /* Overwrite word 1 */
+    patch_loadval(stream, to_change, r5, Seq_length(stream));
+    int to_end = Seq_length(stream);
+    emit(stream, loadval(r5, 0));
+    emit_word(stream, r2, r3, loadval(r1, 'b'));
+    emit(stream, loadval(r6, 1));
+    emit(stream, segstore(r0, r6, r2));
+    emit(stream, loadval(r6, 1));
+    emit(stream, load_program(r0, r0, r6));
+
+    /* Outputting newline and halting */
+    patch_loadval(stream, to_end, r5, Seq_length(stream));
+    emit(stream, loadval(r0, '\n'));
+    emit(stream, output(r0));
+    emit(stream, halt());
+}
+
+/* Test stores into the code that is running: two stores overwrite the
+ * load values just after them, in the same block and the same 16-word
+ * page, so 'y' and '!' are printed instead of 'n' and '?'
+ */
+void emit_smc_running_test(Seq_T stream)
+{
+    emit_word(stream, r2, r3, loadval(r1, 'y'));
+    emit_word(stream, r6, r3, loadval(r7, '!'));
+
+    int to_later = Seq_length(stream);
+    emit(stream, loadval(r4, 0));
+    emit(stream, segstore(r0, r4, r6));
+    int to_next = Seq_length(stream);
+    emit(stream, loadval(r4, 0));
+    emit(stream, segstore(r0, r4, r2));
+
+    patch_loadval(stream, to_next, r4, Seq_length(stream));
+    emit(stream, loadval(r1, 'n'));
+    patch_loadval(stream, to_later, r4, Seq_length(stream));
+    emit(stream, loadval(r7, '?'));
+    emit(stream, output(r1));
+    emit(stream, output(r7));
+
+    /* Outputting newline and halting */
+    emit(stream, loadval(r0, '\n'));
+    emit(stream, output(r0));
+    emit(stream, halt());
+}
+
+/* Test end of input: copies input to output until IN gives ~0, then
+ * reads again, which must give ~0 again, and prints '0' + (that + 1)
+ */
+void emit_echo_eof_test(Seq_T stream)
+{
+    emit(stream, input(r1));
+    emit(stream, loadval(r3, 1));
+    emit(stream, add(r2, r1, r3));
+    int to_end = Seq_length(stream);
+    emit(stream, loadval(r5, 0));
+    int to_print = Seq_length(stream);
+    emit(stream, loadval(r4, 0));
+    emit(stream, conditional_move(r5, r4, r2));
+    emit(stream, load_program(r0, r0, r5));
+
+    /* Not the end: print the byte and read the next */
+    patch_loadval(stream, to_print, r4, Seq_length(stream));
+    emit(stream, output(r1));
+    emit(stream, loadval(r5, 0));
+    emit(stream, load_program(r0, r0, r5));
+
+    patch_loadval(stream, to_end, r5, Seq_length(stream));
+    emit(stream, input(r1));
+    emit(stream, loadval(r3, 1));
+    emit(stream, add(r2, r1, r3));
+    emit(stream, loadval(r3, '0'));
+    emit(stream, add(r2, r2, r3));
+    emit(stream, output(r2));
+
+    /* Outputting newline and halting */
+    emit(stream, loadval(r0, '\n'));
+    emit(stream, output(r0));
+    emit(stream, halt());
+}
+
+/* Test that the copy-on-write copy of segment 0 counts toward --max-mem:
+ * runs from a 1M-word copy of itself, then stores into segment 0, which
+ * takes 2M words between the two (not counting the program)
+ */
+void emit_quota_copy_test(Seq_T stream)
+{
+    int to_len = emit_copy_self(stream, 1 << 20);
+    int to_copy = Seq_length(stream);
+    emit(stream, loadval(r3, 0));
+    emit(stream, load_program(r0, r6, r3));
+
+    /* Running from r6: store past the code to make a private copy */
+    patch_loadval(stream, to_copy, r3, Seq_length(stream));
+    emit(stream, loadval(r2, 1 << 19));
+    emit(stream, segstore(r0, r2, r2));
+
+    emit(stream, loadval(r1, 'o'));
+    emit(stream, output(r1));
+    emit(stream, loadval(r1, 'k'));
+    emit(stream, output(r1));
+    emit(stream, loadval(r0, '\n'));
+    emit(stream, output(r0));
+    emit(stream, halt());
+
+    patch_loadval(stream, to_len, r1, Seq_length(stream));
+}
+
+/* Test that segments merged by deduplication count toward --max-mem
+ * again once they are stored to: maps eight zeroed 1M-word segments
+ * (IDs 2 to 9), running two load_programs after each so a --dedup pass
+ * merges it with the others, then stores a word into each
+ */
+void emit_dedup_quota_test(Seq_T stream)
+{
+    int to_len = emit_copy_self(stream, 256);
+    for (int i = 0; i < 8; i++) {
+        emit(stream, loadval(r1, 1 << 20));
+        emit(stream, mapseg(r0, r7, r1));
+        for (int j = 0; j < 2; j++) {
+            emit(stream, loadval(r3, Seq_length(stream) + 2));
+            emit(stream, load_program(r0, r6, r3));
+        }
+    }
+
+    emit(stream, loadval(r3, 1));
+    for (unsigned id = 2; id < 10; id++) {
+        emit(stream, loadval(r2, id));
+        emit(stream, segstore(r2, r0, r3));
+    }
+
+    emit(stream, loadval(r1, 'o'));
+    emit(stream, output(r1));
+    emit(stream, loadval(r1, 'k'));
+    emit(stream, output(r1));
+    emit(stream, loadval(r0, '\n'));
+    emit(stream, output(r0));
+    emit(stream, halt());
+
+    patch_loadval(stream, to_len, r1, Seq_length(stream));
+}
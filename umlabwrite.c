@@ -29,6 +29,16 @@ extern void emit_verbose_add_test(Seq_T instructions);
 extern void emit_segments_test(Seq_T instructions);
 extern void emit_nand_test(Seq_T instructions);
 extern void emit_arithmetic_test(Seq_T instructions);
+extern void emit_dedup_unmap_test(Seq_T instructions);
+extern void emit_div_fault_test(Seq_T instructions);
+extern void emit_invalid_fault_test(Seq_T instructions);
+extern void emit_smc_block_test(Seq_T instructions);
+extern void emit_smc_fused_test(Seq_T instructions);
+extern void emit_smc_same_test(Seq_T instructions);
+extern void emit_smc_running_test(Seq_T instructions);
+extern void emit_echo_eof_test(Seq_T instructions);
+extern void emit_quota_copy_test(Seq_T instructions);
+extern void emit_dedup_quota_test(Seq_T instructions);
 
 /* The array `tests` contains all unit tests for the lab. */
 
@@ -53,7 +63,17 @@ static struct test_info {
         { "add-verbose", NULL, "", emit_verbose_add_test },
         { "segments", NULL, "", emit_segments_test },
         { "nand", NULL, "", emit_nand_test },
-        { "arithmetic", NULL, "", emit_arithmetic_test }
+        { "arithmetic", NULL, "", emit_arithmetic_test },
+        { "dedup-unmap", NULL, "k\n", emit_dedup_unmap_test },
+        { "div-fault", NULL, "A\n", emit_div_fault_test },
+        { "invalid-fault", NULL, "C\n", emit_invalid_fault_test },
+        { "smc-block", NULL, "ab\n", emit_smc_block_test },
+        { "smc-fused", NULL, "abc\n", emit_smc_fused_test },
+        { "smc-same", NULL, "aab\n", emit_smc_same_test },
+        { "smc-running", NULL, "y!\n", emit_smc_running_test },
+        { "echo-eof", "hello\n", "hello\n0\n", emit_echo_eof_test },
+        { "quota-copy", NULL, "ok\n", emit_quota_copy_test },
+        { "dedup-quota", NULL, "ok\n", emit_dedup_quota_test }
 };
   
 #define NTESTS (sizeof(tests)/sizeof(tests[0]))